@@ -0,0 +1,246 @@
+/*
+ * bench - Throughput benchmark for the kernellab debugfs modules
+ *
+ * Measures paddr translations/sec over growing address spaces and ptree
+ * queries/sec over growing process tree depths. After every paddr run the
+ * walk timing exported by the module (paddr/stats) is dumped.
+ * The ptree part is skipped when the ptree module is not loaded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PADDR_FILE_PATH         "/sys/kernel/debug/paddr/output"
+#define PADDR_STATS_PATH        "/sys/kernel/debug/paddr/stats"
+#define PTREE_INPUT_PATH        "/sys/kernel/debug/ptree/input"
+#define PTREE_OUTPUT_PATH       "/sys/kernel/debug/ptree/ptree"
+#define PTREE_SUBTREE_PATH      "/sys/kernel/debug/ptree/subtree"
+
+#define PAGE_SIZE       4096
+#define ROUNDS          4       /* passes over the address space per size */
+#define PTREE_QUERIES   20000   /* ptree queries per chain depth */
+
+struct packet {
+        pid_t pid;
+        unsigned long vaddr;
+        unsigned long paddr;
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void dump_stats(void)
+{
+        char buf[1024];
+        int fd, n;
+
+        if ((fd = open(PADDR_STATS_PATH, O_RDONLY)) < 0)
+                return;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+                fwrite(buf, 1, n, stdout);
+        close(fd);
+}
+
+static void reset_stats(void)
+{
+        int fd;
+
+        if ((fd = open(PADDR_STATS_PATH, O_WRONLY)) < 0)
+                return;
+        if (write(fd, "0", 1) != 1)
+                printf("failed to reset %s\n", PADDR_STATS_PATH);
+        close(fd);
+}
+
+static void bench_paddr(void)
+{
+        static const size_t sizes_mb[] = { 1, 16, 64, 256, 1024 };
+        struct packet pckt;
+        size_t i, page, npages;
+        char *region;
+        double start, elapsed;
+        long ok, fail;
+        int fd, r;
+
+        if ((fd = open(PADDR_FILE_PATH, O_RDWR)) < 0) {
+                printf("debugfs file open error\n");
+                exit(-1);
+        }
+
+        printf("%10s %12s %14s %8s\n", "size(MB)", "translations", "trans/sec", "failed");
+        for (i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]); i++) {
+                npages = sizes_mb[i] * 1024 * 1024 / PAGE_SIZE;
+                region = mmap(NULL, npages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+                if (region == MAP_FAILED) {
+                        printf("mmap of %zu MB failed\n", sizes_mb[i]);
+                        break;
+                }
+
+                reset_stats();
+                ok = fail = 0;
+                start = now();
+                for (r = 0; r < ROUNDS; r++) {
+                        for (page = 0; page < npages; page++) {
+                                pckt.pid = getpid();
+                                pckt.vaddr = (unsigned long)(region + page * PAGE_SIZE);
+                                pckt.paddr = 0;
+                                if (pread(fd, &pckt, sizeof(struct packet), 0) < 0)
+                                        fail++;
+                                else
+                                        ok++;
+                        }
+                }
+                elapsed = now() - start;
+
+                printf("%10zu %12ld %14.0f %8ld\n", sizes_mb[i], ok, (ok + fail) / elapsed, fail);
+                dump_stats();
+                munmap(region, npages * PAGE_SIZE);
+        }
+
+        close(fd);
+}
+
+static int ptree_query(pid_t pid)
+{
+        char buf[2048];
+        int fd, len;
+
+        if ((fd = open(PTREE_INPUT_PATH, O_WRONLY)) < 0)
+                return -1;
+        len = snprintf(buf, sizeof(buf), "%d", pid);
+        if (write(fd, buf, len) != len) {
+                close(fd);
+                return -1;
+        }
+        close(fd);
+
+        if ((fd = open(PTREE_OUTPUT_PATH, O_RDONLY)) < 0)
+                return -1;
+        len = read(fd, buf, sizeof(buf));
+        close(fd);
+        return len;
+}
+
+static int subtree_query(pid_t pid)
+{
+        char buf[2048];
+        int fd, len;
+
+        if ((fd = open(PTREE_SUBTREE_PATH, O_RDWR)) < 0)
+                return -1;
+        len = snprintf(buf, sizeof(buf), "%d", pid);
+        if (write(fd, buf, len) != len) {
+                close(fd);
+                return -1;
+        }
+        len = pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        return len;
+}
+
+/*
+ * spawn_chain - Fork a chain of depth processes, each the child of the one
+ *     before, all in a new process group. Returns the group id and stores
+ *     the pid of the deepest process in *leaf.
+ */
+static pid_t spawn_chain(int depth, pid_t *leaf)
+{
+        pid_t top, me;
+        int fds[2];
+        int d;
+
+        if (pipe(fds) < 0)
+                return -1;
+        if ((top = fork()) < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                return -1;
+        }
+        if (top == 0) {
+                close(fds[0]);
+                setpgid(0, 0);
+                for (d = 1; d < depth; d++)
+                        if (fork() != 0)
+                                break;  /* the parent, or the fork failed */
+                if (d == depth) {
+                        me = getpid();
+                        if (write(fds[1], &me, sizeof(me)) != sizeof(me))
+                                exit(1);
+                }
+                close(fds[1]);
+                pause();
+                exit(0);
+        }
+        close(fds[1]);
+        setpgid(top, top);
+
+        /* only the leaf keeps the write end open: EOF means no leaf */
+        if (read(fds[0], leaf, sizeof(*leaf)) != sizeof(*leaf)) {
+                close(fds[0]);
+                kill(-top, SIGKILL);
+                waitpid(top, NULL, 0);
+                return -1;
+        }
+        close(fds[0]);
+        return top;
+}
+
+static void bench_ptree(void)
+{
+        /* the ptree module formats the whole ancestry into one 2K buffer,
+           so the chain has to stay well under ~100 levels */
+        static const int depths[] = { 1, 8, 32, 64 };
+        pid_t top, leaf;
+        double start, elapsed;
+        size_t i;
+        int q;
+
+        if (access(PTREE_INPUT_PATH, W_OK) < 0) {
+                printf("ptree module not loaded, skipping ptree benchmark\n");
+                return;
+        }
+
+        printf("%10s %14s %14s\n", "depth", "ptree q/sec", "subtree q/sec");
+        for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+                if ((top = spawn_chain(depths[i], &leaf)) < 0) {
+                        printf("failed to build a chain of depth %d\n", depths[i]);
+                        break;
+                }
+
+                start = now();
+                for (q = 0; q < PTREE_QUERIES; q++)
+                        ptree_query(leaf);
+                elapsed = now() - start;
+                printf("%10d %14.0f", depths[i], PTREE_QUERIES / elapsed);
+
+                start = now();
+                for (q = 0; q < PTREE_QUERIES / 100; q++)
+                        subtree_query(top);
+                elapsed = now() - start;
+                printf(" %14.0f\n", (PTREE_QUERIES / 100) / elapsed);
+
+                /* the rest of the chain is reparented and reaped by init */
+                kill(-top, SIGKILL);
+                waitpid(top, NULL, 0);
+        }
+}
+
+int main(void)
+{
+        bench_paddr();
+        bench_ptree();
+
+        return 0;
+}
@@ -1,8 +1,11 @@
 #include <linux/debugfs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/uaccess.h>
 #include <linux/pgtable.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
 #include <asm/pgtable.h>
 
 MODULE_LICENSE("GPL");
@@ -13,9 +16,48 @@ struct packet {
         unsigned long paddr;
 };
 
-static struct dentry *dir, *output;
+#define STATBUFSIZE 1024
+
+/* page walk levels, in walk order */
+enum walk_level { LV_PGD, LV_P4D, LV_PUD, LV_PMD, LV_PTE, NR_LEVELS };
+
+static const char *level_name[NR_LEVELS] = { "pgd", "p4d", "pud", "pmd", "pte" };
+
+/*
+ * Per level timing costs a clock read and two shared atomics per level,
+ * more than the dereference it measures, so it is off unless asked for.
+ * Whole walks are always timed, once per read.
+ */
+static bool level_stats;
+module_param(level_stats, bool, 0644);
+MODULE_PARM_DESC(level_stats, "Time every page table level (slows each walk)");
+
+/* whole walk counters */
+static atomic64_t walk_cnt;
+static atomic64_t walk_ns;
+static atomic64_t walk_fail;
+
+/* per level counters: walks that got through the level and time spent in it */
+static atomic64_t level_cnt[NR_LEVELS];
+static atomic64_t level_ns[NR_LEVELS];
+
+static struct dentry *dir, *output, *stats;
 static struct task_struct *task;
 
+/* account_level - Charge the time since *t to level lv and restart *t */
+static inline void account_level(enum walk_level lv, u64 *t)
+{
+    u64 now;
+
+    if (!level_stats)
+        return;
+    now = ktime_get_ns();
+
+    atomic64_inc(&level_cnt[lv]);
+    atomic64_add(now - *t, &level_ns[lv]);
+    *t = now;
+}
+
 static ssize_t read_output(struct file *fp,
                         char __user *user_buffer,
                         size_t length,
@@ -31,6 +73,7 @@ static ssize_t read_output(struct file *fp,
     pud_t *pud;
     pmd_t *pmd;
     pte_t *pte;
+    u64 start, t;
 
     if ((ret = copy_from_user(&pckt, user_buffer, length)) < 0) return -EFAULT;
 
@@ -41,30 +84,100 @@ static ssize_t read_output(struct file *fp,
     
     mm = task->mm;
 
+    start = t = ktime_get_ns();
+
     pgd = pgd_offset(mm, vaddr);
-    if(pgd_none(*pgd) || pgd_bad(*pgd)) return -EINVAL;
+    if(pgd_none(*pgd) || pgd_bad(*pgd)) goto fail;
+    account_level(LV_PGD, &t);
 
     p4d = p4d_offset(pgd, vaddr);
-    if(p4d_none(*p4d) || p4d_bad(*p4d)) return -EINVAL;
+    if(p4d_none(*p4d) || p4d_bad(*p4d)) goto fail;
+    account_level(LV_P4D, &t);
 
     pud = pud_offset(p4d, vaddr);
-    if(pud_none(*pud) || pud_bad(*pud)) return -EINVAL;
+    if(pud_none(*pud) || pud_bad(*pud)) goto fail;
+    account_level(LV_PUD, &t);
 
     pmd = pmd_offset(pud, vaddr);
-    if(pmd_none(*pmd) || pmd_bad(*pmd)) return -EINVAL;
+    if(pmd_none(*pmd) || pmd_bad(*pmd)) goto fail;
+    account_level(LV_PMD, &t);
 
     pte = pte_offset_kernel(pmd, vaddr);
-    if(pte_none(*pte) || !pte_present(*pte)) return -EINVAL;
+    if(pte_none(*pte) || !pte_present(*pte)) goto fail;
+    account_level(LV_PTE, &t);
 
     pckt.paddr = pte_val(*pte) & PTE_PFN_MASK;
 
+    atomic64_inc(&walk_cnt);
+    atomic64_add(ktime_get_ns() - start, &walk_ns);
+
     return simple_read_from_buffer(user_buffer, length, position, &pckt, sizeof(pckt));
+
+fail:
+    atomic64_inc(&walk_fail);
+    return -EINVAL;
+}
+
+/*
+ * read_stats - Report how many walks completed and the total/average time
+ *     spent in them, and, with level_stats set, the same per page table level
+ */
+static ssize_t read_stats(struct file *fp,
+                        char __user *user_buffer,
+                        size_t length,
+                        loff_t *position)
+{
+    char buf[STATBUFSIZE];
+    int cursor = 0;
+    s64 wcnt = atomic64_read(&walk_cnt);
+    s64 wns = atomic64_read(&walk_ns);
+    int i;
+
+    cursor += scnprintf(buf + cursor, STATBUFSIZE - cursor, "%-5s %12s %16s %10s\n",
+                        "level", "count", "total_ns", "avg_ns");
+    cursor += scnprintf(buf + cursor, STATBUFSIZE - cursor, "%-5s %12lld %16lld %10lld\n",
+                        "walk", wcnt, wns, wcnt ? wns / wcnt : 0);
+    for (i = 0; level_stats && i < NR_LEVELS; i++) {
+        s64 cnt = atomic64_read(&level_cnt[i]);
+        s64 ns = atomic64_read(&level_ns[i]);
+
+        cursor += scnprintf(buf + cursor, STATBUFSIZE - cursor, "%-5s %12lld %16lld %10lld\n",
+                            level_name[i], cnt, ns, cnt ? ns / cnt : 0);
+    }
+    cursor += scnprintf(buf + cursor, STATBUFSIZE - cursor, "failed walks: %lld\n",
+                        atomic64_read(&walk_fail));
+
+    return simple_read_from_buffer(user_buffer, length, position, buf, cursor);
+}
+
+/* write_stats - Any write resets the counters */
+static ssize_t write_stats(struct file *fp,
+                        const char __user *user_buffer,
+                        size_t length,
+                        loff_t *position)
+{
+    int i;
+
+    for (i = 0; i < NR_LEVELS; i++) {
+        atomic64_set(&level_cnt[i], 0);
+        atomic64_set(&level_ns[i], 0);
+    }
+    atomic64_set(&walk_cnt, 0);
+    atomic64_set(&walk_ns, 0);
+    atomic64_set(&walk_fail, 0);
+
+    return length;
 }
 
 static const struct file_operations dbfs_fops = {
 	.read = read_output
 };
 
+static const struct file_operations dbfs_stats_fops = {
+	.read = read_stats,
+	.write = write_stats
+};
+
 static int __init dbfs_module_init(void)
 {
 	if (!(dir = debugfs_create_dir("paddr", NULL))) {
@@ -77,6 +190,11 @@ static int __init dbfs_module_init(void)
         return -1;
     }
 
+	if (!(stats = debugfs_create_file("stats", S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH, dir, NULL, &dbfs_stats_fops))) {
+        printk("Failed to create stats file\n");
+        return -1;
+    }
+
 	printk("dbfs_paddr module initialize done\n");
 
 	return 0;
@@ -5,14 +5,21 @@
 #include <linux/list.h>
 #include <linux/stat.h>
 #include <linux/slab.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/cputime.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 
 #define BUFSIZE 2048
 
 MODULE_LICENSE("GPL");
 
-static struct dentry *dir, *inputdir, *ptreedir;
+static struct dentry *dir, *inputdir, *ptreedir, *subtreedir;
 static struct task_struct *curr;
 static char *buf;
+static char *subtree_buf;
+static DEFINE_MUTEX(subtree_mutex);  /* serializes users of subtree_buf */
 
 struct process_item {
     pid_t pid;
@@ -20,6 +27,23 @@ struct process_item {
     struct list_head list;
 };
 
+struct subtree_item {
+    struct task_struct *task;
+    struct list_head list;
+};
+
+/* aggregated accounting of a process and all of its descendants */
+struct subtree_stat {
+    unsigned long nr_procs;
+    u64 utime;              /* nanoseconds */
+    u64 stime;              /* nanoseconds */
+    unsigned long rss;      /* pages */
+    unsigned long min_flt;
+    unsigned long maj_flt;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
+};
+
 static ssize_t write_pid_to_input(struct file *fp, 
                                 const char __user *user_buffer, 
                                 size_t length, 
@@ -64,38 +88,204 @@ static ssize_t read_ptree(struct file *fp,
     return simple_read_from_buffer(user_buffer, length, position, buf, strlen(buf));
 }
 
+/*
+ * collect_subtree - Append every descendant of the task at the head of
+ *     task_list to task_list (breadth first). Children forked by non-leader
+ *     threads hang off that thread's children list, so every thread is
+ *     visited. Called under rcu_read_lock(): tasklist_lock is not exported
+ *     to modules, so each task found is pinned with get_task_struct() and
+ *     accounted after the walk, and tasks already past exit are skipped.
+ */
+static int collect_subtree(struct list_head *task_list)
+{
+    struct subtree_item *pos, *item;
+    struct task_struct *t, *child;
+
+    list_for_each_entry(pos, task_list, list) {
+        if (!pid_alive(pos->task))
+            continue;
+        for_each_thread(pos->task, t) {
+            list_for_each_entry(child, &t->children, sibling) {
+                if (!(item = kmalloc(sizeof(struct subtree_item), GFP_ATOMIC)))
+                    return -ENOMEM;
+                get_task_struct(child);
+                item->task = child;
+                list_add_tail(&item->list, task_list);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* account_task - Add the counters of one process (all threads) to stat */
+static void account_task(struct task_struct *task, struct subtree_stat *stat)
+{
+    struct task_struct *t;
+    struct mm_struct *mm;
+    u64 ut, st;
+
+    rcu_read_lock();
+    if (pid_alive(task)) {
+        /* counters of already exited threads live in signal_struct */
+        stat->utime += task->signal->utime;
+        stat->stime += task->signal->stime;
+        stat->min_flt += task->signal->min_flt;
+        stat->maj_flt += task->signal->maj_flt;
+        stat->nvcsw += task->signal->nvcsw;
+        stat->nivcsw += task->signal->nivcsw;
+
+        for_each_thread(task, t) {
+            /* t->utime/stime can be stale with VIRT_CPU_ACCOUNTING_GEN */
+            task_cputime_adjusted(t, &ut, &st);
+            stat->utime += ut;
+            stat->stime += st;
+            stat->min_flt += t->min_flt;
+            stat->maj_flt += t->maj_flt;
+            stat->nvcsw += t->nvcsw;
+            stat->nivcsw += t->nivcsw;
+        }
+    }
+    rcu_read_unlock();
+
+    if ((mm = get_task_mm(task))) {
+        stat->rss += get_mm_rss(mm);
+        mmput(mm);
+    }
+    stat->nr_procs++;
+}
+
+static ssize_t write_pid_to_subtree(struct file *fp,
+                                const char __user *user_buffer,
+                                size_t length,
+                                loff_t *position)
+{
+    pid_t input_pid;
+    struct task_struct *root;
+    struct subtree_item *item, *pos, *temp;
+    struct subtree_stat stat = { 0 };
+    int ret;
+
+    if ((ret = kstrtoint_from_user(user_buffer, length, 10, &input_pid)) < 0)
+        return ret;
+
+    LIST_HEAD(task_list);
+
+    /* RCU keeps the task structs the walk passes through from being
+       freed; the ones it collects are pinned until accounted */
+    rcu_read_lock();
+    if (!(root = pid_task(find_vpid(input_pid), PIDTYPE_PID))) {
+        rcu_read_unlock();
+        return -ESRCH;
+    }
+    if (!(item = kmalloc(sizeof(struct subtree_item), GFP_ATOMIC))) {
+        rcu_read_unlock();
+        return -ENOMEM;
+    }
+    get_task_struct(root);
+    item->task = root;
+    list_add_tail(&item->list, &task_list);
+    ret = collect_subtree(&task_list);
+    rcu_read_unlock();
+
+    list_for_each_entry_safe(pos, temp, &task_list, list) {
+        if (!ret)
+            account_task(pos->task, &stat);
+        put_task_struct(pos->task);
+        list_del(&pos->list);
+        kfree(pos);
+    }
+
+    if (ret)
+        return ret;
+
+    mutex_lock(&subtree_mutex);
+    scnprintf(subtree_buf, BUFSIZE,
+              "pid: %d\n"
+              "processes: %lu\n"
+              "utime_ns: %llu\n"
+              "stime_ns: %llu\n"
+              "rss_pages: %lu\n"
+              "min_flt: %lu\n"
+              "maj_flt: %lu\n"
+              "nvcsw: %lu\n"
+              "nivcsw: %lu\n",
+              input_pid, stat.nr_procs, stat.utime, stat.stime, stat.rss,
+              stat.min_flt, stat.maj_flt, stat.nvcsw, stat.nivcsw);
+    mutex_unlock(&subtree_mutex);
+
+    return length;
+}
+
+static ssize_t read_subtree(struct file *fp,
+                                char __user *user_buffer,
+                                size_t length,
+                                loff_t *position)
+{
+    ssize_t ret;
+
+    mutex_lock(&subtree_mutex);
+    ret = simple_read_from_buffer(user_buffer, length, position, subtree_buf, strlen(subtree_buf));
+    mutex_unlock(&subtree_mutex);
+    return ret;
+}
+
 static const struct file_operations dbfs_fops = {
     .write = write_pid_to_input,
     .read = read_ptree
 };
 
+static const struct file_operations dbfs_subtree_fops = {
+    .write = write_pid_to_subtree,
+    .read = read_subtree
+};
+
 
 static int __init dbfs_module_init(void)
 {
+    buf = kmalloc(BUFSIZE, GFP_KERNEL);
+    subtree_buf = kzalloc(BUFSIZE, GFP_KERNEL);
+    if (!buf || !subtree_buf) {
+        kfree(buf);
+        kfree(subtree_buf);
+        return -ENOMEM;
+    }
+
     if (!(dir = debugfs_create_dir("ptree", NULL))) {
         printk("Failed to create ptree dir\n");
-        return -1;
+        goto fail;
     }
 
     if (!(inputdir = debugfs_create_file("input", S_IRWXU|S_IRWXG|S_IRWXO, dir, NULL, &dbfs_fops))) {
         printk("Failed to create input file\n");
-        return -1;
+        goto fail;
     }
 
     if (!(ptreedir = debugfs_create_file("ptree", S_IRWXU|S_IRWXG|S_IRWXO, dir, NULL, &dbfs_fops))) {
         printk("Failed to create ptree file\n");
-        return -1;
+        goto fail;
+    }
+
+    if (!(subtreedir = debugfs_create_file("subtree", S_IRWXU|S_IRWXG|S_IRWXO, dir, NULL, &dbfs_subtree_fops))) {
+        printk("Failed to create subtree file\n");
+        goto fail;
     }
 
 	printk("dbfs_ptree module initialize done\n");
-    buf = kmalloc(BUFSIZE, GFP_KERNEL);
     return 0;
+
+fail:
+    debugfs_remove_recursive(dir);
+    kfree(buf);
+    kfree(subtree_buf);
+    return -1;
 }
 
 static void __exit dbfs_module_exit(void)
 {
     debugfs_remove_recursive(dir);
     kfree(buf);
+    kfree(subtree_buf);
 	printk("dbfs_ptree module exit\n");
 }
 
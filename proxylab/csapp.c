@@ -24,10 +24,35 @@
 /************************** 
  * Error-handling functions
  **************************/
+
+/*
+ * A thread that called soft_errors(1) doesn't die on errors: the
+ * error-handling functions record the first error in thread-local
+ * storage and return, and the wrapper returns the failing call's result
+ * (-1, NULL, a short count). So a server thread can check last_error()
+ * at convenient points and drop its connection, while the others go on.
+ */
+static __thread int err_soft;          /* This thread's errors are soft */
+static __thread csapp_error_t err_last; /* Its first error since clear_error */
+
+static int soft_error(int kind, int code, char *msg)
+{
+    if (!err_soft)
+	return 0;
+    if (!err_last.kind) {
+	err_last.kind = kind;
+	err_last.code = code;
+	snprintf(err_last.msg, sizeof(err_last.msg), "%s", msg);
+    }
+    return 1;
+}
+
 /* $begin errorfuns */
 /* $begin unixerror */
 void unix_error(char *msg) /* Unix-style error */
 {
+    if (soft_error(ERR_UNIX, errno, msg))
+	return;
     fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(0);
 }
@@ -35,18 +60,24 @@ void unix_error(char *msg) /* Unix-style error */
 
 void posix_error(int code, char *msg) /* Posix-style error */
 {
+    if (soft_error(ERR_POSIX, code, msg))
+	return;
     fprintf(stderr, "%s: %s\n", msg, strerror(code));
     exit(0);
 }
 
 void gai_error(int code, char *msg) /* Getaddrinfo-style error */
 {
+    if (soft_error(ERR_GAI, code, msg))
+	return;
     fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
     exit(0);
 }
 
 void app_error(char *msg) /* Application error */
 {
+    if (soft_error(ERR_APP, 0, msg))
+	return;
     fprintf(stderr, "%s\n", msg);
     exit(0);
 }
@@ -54,10 +85,30 @@ void app_error(char *msg) /* Application error */
 
 void dns_error(char *msg) /* Obsolete gethostbyname error */
 {
+    if (soft_error(ERR_DNS, h_errno, msg))
+	return;
     fprintf(stderr, "%s\n", msg);
     exit(0);
 }
 
+/* soft_errors - Make errors in this thread non-fatal (on) or fatal again */
+void soft_errors(int on)
+{
+    err_soft = on;
+}
+
+/* last_error - This thread's first error since clear_error, or NULL */
+const csapp_error_t *last_error(void)
+{
+    return err_last.kind ? &err_last : NULL;
+}
+
+/* clear_error - Forget this thread's error, say for a new connection */
+void clear_error(void)
+{
+    err_last.kind = 0;
+}
+
 
 /*********************************************
  * Wrappers for Unix process control functions
@@ -781,6 +832,163 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+#define RIO_IOVMAX 64           /* iovecs per rio_writev system call */
+
+/*
+ * rio_sendv - Robustly write all of iov, which is updated as it goes.
+ *    With more, sendmsg is told with MSG_MORE that more data follows
+ *    (writev is used if fd is not a socket).
+ */
+static ssize_t rio_sendv(int fd, struct iovec *iov, int iovcnt, int more)
+{
+    struct msghdr msg;
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0) {
+	if (iov->iov_len == 0) {    /* Skip what has been written */
+	    iov++;
+	    iovcnt--;
+	    continue;
+	}
+	if (more) {
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_iov = iov;
+	    msg.msg_iovlen = iovcnt;
+	    nwritten = sendmsg(fd, &msg, MSG_MORE | MSG_NOSIGNAL);
+	    if (nwritten < 0 && errno == ENOTSOCK) {
+		more = 0;
+		continue;
+	    }
+	} else
+	    nwritten = writev(fd, iov, iovcnt);
+	if (nwritten < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+
+	/* Resume after a partial write where it stopped */
+	while (nwritten > 0) {
+	    if (nwritten >= iov->iov_len) {
+		nwritten -= iov->iov_len;
+		iov->iov_len = 0;
+	    } else {
+		iov->iov_base = (char *)iov->iov_base + nwritten;
+		iov->iov_len -= nwritten;
+		nwritten = 0;
+	    }
+	    if (iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	    }
+	}
+    }
+    return total;
+}
+
+/*
+ * rio_writev - Robustly write the iovcnt buffers of iov (unbuffered),
+ *    with as few system calls as the descriptor allows
+ */
+ssize_t rio_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[RIO_IOVMAX];
+    ssize_t n, total = 0;
+    int cnt;
+
+    while (iovcnt > 0) {
+	cnt = iovcnt < RIO_IOVMAX ? iovcnt : RIO_IOVMAX;
+	memcpy(v, iov, cnt * sizeof(struct iovec));
+	if ((n = rio_sendv(fd, v, cnt, 0)) < 0)
+	    return -1;
+	total += n;
+	iov += cnt;
+	iovcnt -= cnt;
+    }
+    return total;
+}
+
+/*
+ * The internal buffers come from a pool shared by all rio_t's, with a
+ * free list per power-of-two size from RIO_MINBUFSIZE to RIO_MAXBUFSIZE,
+ * so that connections can start with a small buffer, grow it when a
+ * read fills it up, and give it back while idle, without a malloc and
+ * free each time.
+ */
+#define RIO_POOLCLASSES 10  /* 512 bytes to 256K */
+#define RIO_POOLKEEP    64  /* Free buffers kept per size */
+
+static struct {
+    char *free[RIO_POOLKEEP];
+    int nfree;
+} rio_pool[RIO_POOLCLASSES];
+static pthread_mutex_t rio_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* rio_class - Size class of a buffer of at least size bytes */
+static int rio_class(size_t size)
+{
+    int c = 0;
+
+    while (c < RIO_POOLCLASSES - 1 && (RIO_MINBUFSIZE << c) < size)
+	c++;
+    return c;
+}
+
+/* rio_pool_put - Give a buffer of the given size back to the pool */
+static void rio_pool_put(char *buf, size_t size)
+{
+    int c = rio_class(size);
+
+    pthread_mutex_lock(&rio_pool_mutex);
+    if (rio_pool[c].nfree < RIO_POOLKEEP) {
+	rio_pool[c].free[rio_pool[c].nfree++] = buf;
+	buf = NULL;
+    }
+    pthread_mutex_unlock(&rio_pool_mutex);
+    free(buf);                  /* The pool is full */
+}
+
+/*
+ * rio_pool_get - Take a buffer of the size class of size (at least size
+ *    bytes, *sizep set to its actual size) from the pool. Returns NULL
+ *    with errno set if no memory is left.
+ */
+static char *rio_pool_get(size_t size, size_t *sizep)
+{
+    int c = rio_class(size);
+    char *buf = NULL;
+
+    pthread_mutex_lock(&rio_pool_mutex);
+    if (rio_pool[c].nfree > 0)
+	buf = rio_pool[c].free[--rio_pool[c].nfree];
+    pthread_mutex_unlock(&rio_pool_mutex);
+    if (!buf)
+	buf = malloc(RIO_MINBUFSIZE << c);
+    *sizep = RIO_MINBUFSIZE << c;
+    return buf;
+}
+
+/*
+ * rio_resize - Move rp's unread bytes to the front of a pool buffer of
+ *    the size class of size (which must hold them) and give back the old
+ *    buffer. Returns -1 with errno set if no memory is left.
+ */
+static int rio_resize(rio_t *rp, size_t size)
+{
+    char *buf;
+
+    if (!(buf = rio_pool_get(size, &size)))
+	return -1;
+
+    if (rp->rio_cnt > 0)
+	memcpy(buf, rp->rio_bufptr, rp->rio_cnt);
+    if (rp->rio_buf)
+	rio_pool_put(rp->rio_buf, rp->rio_bufsize);
+    rp->rio_buf = rp->rio_bufptr = buf;
+    rp->rio_bufsize = size;
+    return 0;
+}
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -788,25 +996,38 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() (rio_fill) if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	if (!rp->rio_buf && rio_resize(rp, rp->rio_initsize) < 0)
+	    return -1;          /* Released by rio_releaseb */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
 	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
+	    if (errno != EINTR) { /* Interrupted by sig handler return */
+		rp->rio_cnt = 0;  /* Still empty if called again (EAGAIN) */
 		return -1;
+	    }
 	}
 	else if (rp->rio_cnt == 0)  /* EOF */
 	    return 0;
-	else 
+	else {
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+	    if (rp->rio_cnt == rp->rio_bufsize && rp->rio_bufsize < rp->rio_maxsize)
+		rio_resize(rp, 2 * rp->rio_bufsize); /* Bulk data: read more at once */
+	}
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;             /* Error or EOF */
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -820,17 +1041,72 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $end rio_read */
 
 /*
- * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ * rio_readinitb - Associate a descriptor with a read buffer and reset buffer.
+ *    The buffer is the fixed one of fp, so there is nothing to give back;
+ *    read through &fp->rio.
  */
 /* $begin rio_readinitb */
-void rio_readinitb(rio_t *rp, int fd) 
+void rio_readinitb(rio_fixed_t *fp, int fd) 
 {
+    rio_t *rp = &fp->rio;
+
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_buf = rp->rio_bufptr = fp->rio_fixedbuf;
+    rp->rio_bufsize = rp->rio_initsize = rp->rio_maxsize = RIO_BUFSIZE;
+    rp->rio_fixed = 1;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readinitb_sized - Same as rio_readinitb, but with a buffer from the
+ *    Rio pool of size bytes that doubles, up to maxsize, each time a read
+ *    fills it. Both are capped at RIO_MAXBUFSIZE. The buffer is taken at
+ *    the first read, and must be given back with rio_freeb.
+ */
+void rio_readinitb_sized(rio_t *rp, int fd, size_t size, size_t maxsize)
+{
+    if (size > RIO_MAXBUFSIZE)
+	size = RIO_MAXBUFSIZE;
+    if (maxsize > RIO_MAXBUFSIZE)
+	maxsize = RIO_MAXBUFSIZE;
+    rp->rio_fd = fd;  
+    rp->rio_cnt = 0;  
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_bufsize = 0;
+    rp->rio_initsize = size;
+    rp->rio_maxsize = maxsize < size ? size : maxsize;
+    rp->rio_fixed = 0;
+}
+
+/*
+ * rio_releaseb - Give back the pool buffer of an idle rp (say a keep-alive
+ *    connection waiting for its next request); the next read takes a
+ *    new one of the initial size. Does nothing if bytes are buffered.
+ */
+void rio_releaseb(rio_t *rp)
+{
+    if (rp->rio_cnt <= 0 && !rp->rio_fixed)
+	rio_freeb(rp);
+}
+
+/*
+ * rio_freeb - Give back the pool buffer of rp, dropping what is buffered.
+ *    A buffer set up by rio_readinitb is just emptied.
+ */
+void rio_freeb(rio_t *rp)
+{
+    rp->rio_cnt = 0;
+    if (rp->rio_fixed) {
+	rp->rio_bufptr = rp->rio_buf;
+	return;
+    }
+    if (rp->rio_buf)
+	rio_pool_put(rp->rio_buf, rp->rio_bufsize);
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_bufsize = 0;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -854,34 +1130,192 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). Rather than
+ *    fetching a byte at a time, the unread part of the internal buffer
+ *    is searched for the newline with memchr (vectorized in libc) and
+ *    copied out with a single memcpy per refill.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    while (n + 1 < maxlen && !nl) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;	  /* Error */
+	else if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+
+	/* Copy up to the newline, or as much as is buffered and fits */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)))
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	bufp += cnt;
+	n += cnt;
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_peeklineb - Return the next text line without copying it: *linep
+ *    is set to point at it inside the internal buffer, and its length
+ *    (including the newline, which is not followed by a NUL) is
+ *    returned. The line stays there until rio_consumeb is called, so
+ *    peeking again returns the same line. A line that runs off the end of
+ *    the buffer is first moved to the front to make room for the rest,
+ *    into a bigger buffer if it is full and may still grow; a line longer
+ *    than the largest buffer allowed is returned in pieces of that size.
+ *    Returns 0 at EOF and -1 on error. On a non-blocking descriptor, it
+ *    returns -1 with errno EAGAIN until a whole line has come in; what
+ *    came in so far stays buffered for the next call.
+ */
+ssize_t rio_peeklineb(rio_t *rp, char **linep)
+{
+    char *nl;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;              /* Error or EOF */
+
+    while (!(nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt))) {
+	if (rp->rio_cnt == rp->rio_bufsize) {
+	    if (rp->rio_bufsize >= rp->rio_maxsize)
+		break;          /* Buffer full: hand out what is there */
+	    if (rio_resize(rp, 2 * rp->rio_bufsize) < 0)
+		return -1;
+	}
+
+	/* Compact, then read the rest of the line after what is buffered */
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		  rp->rio_bufsize - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rc == 0)
+	    break;              /* EOF: the last line has no newline */
+	else
+	    rp->rio_cnt += rc;
+    }
+
+    *linep = rp->rio_bufptr;
+    return nl ? nl - rp->rio_bufptr + 1 : rp->rio_cnt;
+}
+
+/*
+ * rio_consumeb - Drop the first n bytes of what rio_peeklineb returned
+ */
+void rio_consumeb(rio_t *rp, size_t n)
+{
+    if (n > rp->rio_cnt)
+	n = rp->rio_cnt;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer of at
+ *    least size bytes. Small writes are collected there and written with
+ *    a single system call when it fills up or on rio_flushb. With
+ *    RIO_CORK the socket is corked (TCP_CORK) between flushes, with
+ *    RIO_MSGMORE writes before the flush are sent with MSG_MORE; either
+ *    way the kernel sends full segments until rio_flushb. Returns -1 with
+ *    errno set if no memory is left.
+ */
+int rio_writeinitb(rio_wbuf_t *wp, int fd, size_t size, int flags)
+{
+    int on = 1;
+
+    wp->rio_fd = fd;
+    wp->rio_flags = flags;
+    wp->rio_cnt = 0;
+    wp->rio_more = 0;
+    if (!(wp->rio_buf = rio_pool_get(size, &wp->rio_bufsize)))
+	return -1;
+    if (flags & RIO_CORK)       /* Not TCP: nothing to cork */
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    return 0;
+}
+
+/*
+ * rio_writenb - Robustly write n bytes (buffered). Bytes that don't fit
+ *    in the buffer are written together with it in a single writev, so
+ *    large writes are not copied.
+ */
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    struct iovec iov[2];
+
+    if (wp->rio_cnt + n <= wp->rio_bufsize) {
+	memcpy(wp->rio_buf + wp->rio_cnt, usrbuf, n);
+	wp->rio_cnt += n;
+	return n;
+    }
+
+    iov[0].iov_base = wp->rio_buf;
+    iov[0].iov_len = wp->rio_cnt;
+    iov[1].iov_base = usrbuf;
+    iov[1].iov_len = n;
+    if (rio_sendv(wp->rio_fd, iov, 2, wp->rio_flags & RIO_MSGMORE) < 0)
+	return -1;
+    wp->rio_cnt = 0;
+    wp->rio_more = (wp->rio_flags & RIO_MSGMORE) != 0;
+    return n;
+}
+
+/*
+ * rio_flushb - Write what is buffered and push it out (uncorking the
+ *    socket with RIO_CORK). With RIO_MSGMORE and nothing buffered, the
+ *    tail of the last MSG_MORE send is pushed by clearing TCP_CORK,
+ *    which the kernel does even on a socket that was not corked.
+ *    Returns 0, or -1 with errno set.
+ */
+int rio_flushb(rio_wbuf_t *wp)
+{
+    int off = 0, on = 1;
+
+    if (wp->rio_cnt > 0) {
+	if (rio_writen(wp->rio_fd, wp->rio_buf, wp->rio_cnt) < 0)
+	    return -1;
+    } else if (wp->rio_more && !(wp->rio_flags & RIO_CORK))
+	setsockopt(wp->rio_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    wp->rio_cnt = 0;
+    wp->rio_more = 0;
+    if (wp->rio_flags & RIO_CORK) {
+	setsockopt(wp->rio_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	setsockopt(wp->rio_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+    return 0;
+}
+
+/*
+ * rio_freewb - Give back the write buffer, dropping what was not flushed
+ */
+void rio_freewb(rio_wbuf_t *wp)
+{
+    if (wp->rio_buf)
+	rio_pool_put(wp->rio_buf, wp->rio_bufsize);
+    wp->rio_buf = NULL;
+    wp->rio_cnt = 0;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -900,11 +1334,21 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
-void Rio_readinitb(rio_t *rp, int fd)
+void Rio_readinitb(rio_fixed_t *fp, int fd)
 {
-    rio_readinitb(rp, fd);
+    rio_readinitb(fp, fd);
 } 
 
+void Rio_readinitb_sized(rio_t *rp, int fd, size_t size, size_t maxsize)
+{
+    rio_readinitb_sized(rp, fd, size, maxsize);
+}
+
+void Rio_freeb(rio_t *rp)
+{
+    rio_freeb(rp);
+}
+
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
 {
     ssize_t rc;
@@ -923,6 +1367,167 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_peeklineb(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_peeklineb(rp, linep)) < 0)
+	unix_error("Rio_peeklineb error");
+    return rc;
+}
+
+void Rio_consumeb(rio_t *rp, size_t n)
+{
+    rio_consumeb(rp, n);
+}
+
+void Rio_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
+void Rio_writeinitb(rio_wbuf_t *wp, int fd, size_t size, int flags)
+{
+    if (rio_writeinitb(wp, fd, size, flags) < 0)
+	unix_error("Rio_writeinitb error");
+}
+
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    if (rio_writenb(wp, usrbuf, n) < 0)
+	unix_error("Rio_writenb error");
+}
+
+void Rio_flushb(rio_wbuf_t *wp)
+{
+    if (rio_flushb(wp) < 0)
+	unix_error("Rio_flushb error");
+}
+
+void Rio_freewb(rio_wbuf_t *wp)
+{
+    rio_freewb(wp);
+}
+
+/*********************************************************
+ * The non-blocking Rio package - for event-driven servers
+ *
+ * rio_readnb, rio_readlineb and rio_writen loop until they are done,
+ * which on an O_NONBLOCK descriptor ends in EAGAIN with the bytes moved
+ * so far lost to the caller. For those descriptors, read with
+ * rio_peeklineb or rio_readsomeb, which keep what has been read in the
+ * rio_t buffer, and write through an output queue, which keeps what
+ * could not be written yet until the descriptor is writable again.
+ * EAGAIN being routine here, these have no unix_error wrappers.
+ *********************************************************/
+
+/*
+ * rio_readsomeb - Read up to n bytes (buffered), with at most one read()
+ *    when nothing is buffered. Returns the number of bytes read, 0 at EOF,
+ *    or -1 with errno set, EAGAIN if nothing is available yet.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);
+}
+
+/*
+ * rio_outinitq - Associate a descriptor with an empty output queue
+ */
+void rio_outinitq(rio_outq_t *qp, int fd)
+{
+    qp->rio_fd = fd;
+    qp->rio_buf = NULL;
+    qp->rio_off = qp->rio_len = qp->rio_cap = 0;
+}
+
+/*
+ * rio_flushq - Write as much of the queue as the descriptor takes now.
+ *    Returns the number of bytes still queued (0 once all is written; if
+ *    not, wait for the descriptor to be writable and call it again), or
+ *    -1 with errno set on an error other than EAGAIN.
+ */
+ssize_t rio_flushq(rio_outq_t *qp)
+{
+    ssize_t nwritten;
+
+    while (qp->rio_len > 0) {
+	if ((nwritten = write(qp->rio_fd, qp->rio_buf + qp->rio_off, qp->rio_len)) < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    return -1;           /* errno set by write() */
+	}
+	qp->rio_off += nwritten;
+	qp->rio_len -= nwritten;
+    }
+    if (qp->rio_len == 0)
+	qp->rio_off = 0;
+    return qp->rio_len;
+}
+
+/*
+ * rio_writeq - Write n bytes after those already queued: what can't be
+ *    written now is copied to the queue, to be written by rio_flushq.
+ *    Returns n, or -1 with errno set on an error other than EAGAIN (the
+ *    queue is left as it was). Callers should stop producing output for
+ *    a descriptor whose queue keeps growing.
+ */
+ssize_t rio_writeq(rio_outq_t *qp, void *usrbuf, size_t n)
+{
+    char *bufp = usrbuf, *newbuf;
+    size_t nleft = n, cap;
+    ssize_t nwritten;
+
+    /* Nothing queued: try to write directly, without a copy */
+    while (qp->rio_len == 0 && nleft > 0) {
+	if ((nwritten = write(qp->rio_fd, bufp, nleft)) < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    return -1;           /* errno set by write() */
+	}
+	nleft -= nwritten;
+	bufp += nwritten;
+    }
+    if (nleft == 0)
+	return n;
+
+    /* Queue the rest, moving the queued bytes to the front or growing
+       the buffer when it doesn't fit after them */
+    if (qp->rio_off + qp->rio_len + nleft > qp->rio_cap) {
+	if (qp->rio_len + nleft <= qp->rio_cap) {
+	    memmove(qp->rio_buf, qp->rio_buf + qp->rio_off, qp->rio_len);
+	} else {
+	    cap = qp->rio_cap ? qp->rio_cap : RIO_BUFSIZE;
+	    while (cap < qp->rio_len + nleft)
+		cap *= 2;
+	    if (!(newbuf = malloc(cap)))
+		return -1;
+	    memcpy(newbuf, qp->rio_buf + qp->rio_off, qp->rio_len);
+	    free(qp->rio_buf);
+	    qp->rio_buf = newbuf;
+	    qp->rio_cap = cap;
+	}
+	qp->rio_off = 0;
+    }
+    memcpy(qp->rio_buf + qp->rio_off + qp->rio_len, bufp, nleft);
+    qp->rio_len += nleft;
+    return n;
+}
+
+/*
+ * rio_freeq - Free the queue, dropping what was not written
+ */
+void rio_freeq(rio_outq_t *qp)
+{
+    free(qp->rio_buf);
+    rio_outinitq(qp, qp->rio_fd);
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -937,8 +1542,38 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
+    return open_clientfd_timeout(hostname, port, -1);
+}
+/* $end open_clientfd */
+
+#define MAXATTEMPTS 16  /* Addresses tried by open_clientfd_timeout */
+
+/* ms_since - Milliseconds elapsed since start */
+static long ms_since(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * open_clientfd_timeout - Same as open_clientfd, giving up after
+ *     timeout_ms milliseconds (never if timeout_ms < 0) with errno set to
+ *     ETIMEDOUT. The server's addresses are tried "happy eyeballs" style
+ *     (RFC 8305): alternating between IPv6 and IPv4, a new non-blocking
+ *     connect is started every CONNECT_DELAY ms, or as soon as one fails,
+ *     without waiting for the earlier ones to time out, and the first
+ *     connection made wins. So a dead address only costs CONNECT_DELAY.
+ */
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms) {
+    int rc, i, n, nfds, next, err = ETIMEDOUT, clientfd = -1;
     struct addrinfo hints, *listp, *p;
+    struct addrinfo *addrs[MAXATTEMPTS];
+    struct pollfd fds[MAXATTEMPTS];
+    struct timespec start;
+    long elapsed, wait, next_at = 0;
+    socklen_t len;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -949,30 +1584,93 @@ int open_clientfd(char *hostname, char *port) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+    /* Order them alternating between the families, first one first */
+    for (n = 0, p = listp; p && n < MAXATTEMPTS; p = p->ai_next)
+        if (p->ai_family == listp->ai_family)
+            addrs[n++] = p;
+    for (i = 1, p = listp; p && n < MAXATTEMPTS; p = p->ai_next) {
+        if (p->ai_family == listp->ai_family)
+            continue;
+        memmove(&addrs[i + 1], &addrs[i], (n - i) * sizeof(addrs[0]));
+        addrs[i] = p;
+        n++;
+        i = (i + 2 <= n) ? i + 2 : n;
+    }
 
-    /* Clean up */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nfds = next = 0;
+    while (clientfd < 0 && (nfds > 0 || next < n)) {
+        elapsed = ms_since(&start);
+        if (timeout_ms >= 0 && elapsed >= timeout_ms)
+            break;
+
+        /* Start the next attempt: its turn has come, or none is left */
+        if (next < n && (elapsed >= next_at || nfds == 0)) {
+            p = addrs[next++];
+            next_at = elapsed + CONNECT_DELAY;
+            if ((fds[nfds].fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+                err = errno;
+                next_at = elapsed;
+                continue;     /* Socket failed, try the next */
+            }
+            if (connect(fds[nfds].fd, p->ai_addr, p->ai_addrlen) == 0) {
+                clientfd = fds[nfds].fd; /* Connected at once (loopback) */
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                err = errno;
+                close(fds[nfds].fd);
+                next_at = elapsed;
+                continue;     /* Connect failed, try the next */
+            }
+            fds[nfds++].events = POLLOUT;
+        }
+        if (nfds == 0)
+            continue;
+
+        /* Wait until one is done, the next may start, or time is up */
+        wait = -1;
+        if (next < n)
+            wait = next_at - elapsed;
+        if (timeout_ms >= 0 && (wait < 0 || timeout_ms - elapsed < wait))
+            wait = timeout_ms - elapsed;
+        if (poll(fds, nfds, wait < 0 ? -1 : (int)wait) < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (!fds[i].revents)
+                continue;
+            len = sizeof(rc);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &rc, &len) < 0)
+                rc = errno;
+            if (rc == 0 && clientfd < 0) {
+                clientfd = fds[i].fd;   /* The winner */
+            } else if (rc != 0) {
+                err = rc;
+                close(fds[i].fd);
+                next_at = 0;  /* Failed: the next may start now */
+            } else
+                continue;
+            fds[i--] = fds[--nfds];     /* Not in flight any more */
+        }
+    }
+
+    /* Clean up: the attempts still in flight lost */
+    for (i = 0; i < nfds; i++)
+        if (fds[i].fd != clientfd)
+            close(fds[i].fd);
     freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+    if (clientfd < 0) { /* All connects failed, or time is up */
+        errno = err;
         return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+    return clientfd;
 }
-/* $end open_clientfd */
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
@@ -984,9 +1682,25 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opts(port, NULL);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_opts - Same as open_listenfd, tuned by opts (NULL for the
+ *     defaults). The options other than the backlog are best effort: one
+ *     the kernel doesn't support is skipped. The backlog is capped by
+ *     net.core.somaxconn.
+ */
+int open_listenfd_opts(char *port, const listen_opts_t *opts) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
+    listen_opts_t defaults = { 0 };
+
+    if (!opts)
+        opts = &defaults;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -1007,6 +1721,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (opts->reuseport)
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1023,14 +1740,63 @@ int open_listenfd(char *port)
     if (!p) /* No address worked */
         return -1;
 
+    /* Tune it: data-less connections wait in the kernel, first packets
+       may carry data, small writes are not delayed */
+    if (opts->defer_accept)
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   (const void *)&opts->defer_accept, sizeof(int));
+    if (opts->fastopen)
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+                   (const void *)&opts->fastopen, sizeof(int));
+    if (opts->nodelay)
+        setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY,
+                   (const void *)&optval, sizeof(int));
+    if (opts->nonblock && fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, opts->backlog > 0 ? opts->backlog : LISTENQ) < 0) {
         close(listenfd);
 	return -1;
     }
     return listenfd;
 }
-/* $end open_listenfd */
+
+/* accept4 is only declared with _GNU_SOURCE, which clashes with gai_error */
+extern int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+
+/*
+ * accept_batch - Wait for connection requests on the non-blocking
+ *     listenfd, then accept all that are pending, up to max, so that a
+ *     burst of them costs one wakeup. flags are given to accept4
+ *     (SOCK_NONBLOCK, SOCK_CLOEXEC). Returns the number of sockets stored
+ *     in connfds, or -1 with errno set if none could be accepted.
+ */
+int accept_batch(int listenfd, int *connfds, int max, int flags)
+{
+    struct pollfd pfd;
+    int n = 0, fd;
+
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
+    while (n < max) {
+        if ((fd = accept4(listenfd, NULL, NULL, flags)) >= 0) {
+            connfds[n++] = fd;
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;             /* Try again, or the next one */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return n > 0 ? n : -1; /* EMFILE and such */
+        if (n > 0)
+            break;                /* Drained */
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+    return n;
+}
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1044,6 +1810,15 @@ int Open_clientfd(char *hostname, char *port)
     return rc;
 }
 
+int Open_clientfd_timeout(char *hostname, char *port, int timeout_ms) 
+{
+    int rc;
+
+    if ((rc = open_clientfd_timeout(hostname, port, timeout_ms)) < 0) 
+	unix_error("Open_clientfd_timeout error");
+    return rc;
+}
+
 int Open_listenfd(char *port) 
 {
     int rc;
@@ -1053,4 +1828,22 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_opts(char *port, const listen_opts_t *opts) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opts(port, opts)) < 0)
+	unix_error("Open_listenfd_opts error");
+    return rc;
+}
+
+int Accept_batch(int listenfd, int *connfds, int max, int flags) 
+{
+    int rc;
+
+    if ((rc = accept_batch(listenfd, connfds, max, flags)) < 0)
+	unix_error("Accept_batch error");
+    return rc;
+}
+
 /* $end csapp.c */
@@ -25,8 +25,11 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -42,15 +45,58 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE    8192        /* Default size of the internal buf */
+#define RIO_MINBUFSIZE 512         /* Smallest internal buf */
+#define RIO_MAXBUFSIZE (256*1024)  /* Largest internal buf */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, from the Rio pool */
+    size_t rio_bufsize;        /* Its size */
+    size_t rio_initsize;       /* Size to start with, and after rio_releaseb */
+    size_t rio_maxsize;        /* Size it may grow to */
+    int rio_fixed;             /* rio_buf is a rio_fixed_t's, not the pool's */
 } rio_t;
+
+/* A rio_t with a buffer of its own (rio_readinitb): nothing to free */
+typedef struct {
+    rio_t rio;
+    char rio_fixedbuf[RIO_BUFSIZE];
+} rio_fixed_t;
 /* $end rio_t */
 
+/* Write buffer coalescing small writes (rio_writenb) */
+#define RIO_CORK    1          /* Hold partial TCP segments until rio_flushb */
+#define RIO_MSGMORE 2          /* Send with MSG_MORE until rio_flushb */
+typedef struct {
+    int rio_fd;                /* Descriptor for this internal buf */
+    int rio_flags;             /* RIO_CORK, RIO_MSGMORE */
+    size_t rio_cnt;            /* Bytes waiting in internal buf */
+    char *rio_buf;             /* Internal buffer, from the Rio pool */
+    size_t rio_bufsize;        /* Its size */
+    int rio_more;              /* Last send had MSG_MORE: the tail is held back */
+} rio_wbuf_t;
+
+/* Tuning of a listening socket (open_listenfd_opts) */
+typedef struct {
+    int backlog;               /* listen() backlog, 0 for LISTENQ */
+    int defer_accept;          /* TCP_DEFER_ACCEPT: wake up on data, seconds */
+    int fastopen;              /* TCP_FASTOPEN queue length, 0 for off */
+    int nodelay;               /* TCP_NODELAY, inherited by accepted sockets */
+    int reuseport;             /* SO_REUSEPORT, for one listener per thread */
+    int nonblock;              /* O_NONBLOCK, needed by accept_batch */
+} listen_opts_t;
+
+/* Output queue of the non-blocking Rio package */
+typedef struct {
+    int rio_fd;                /* Descriptor written to */
+    char *rio_buf;             /* Bytes not written yet (malloc'ed) */
+    size_t rio_off;            /* Offset of the first of them */
+    size_t rio_len;            /* Their number */
+    size_t rio_cap;            /* Size of rio_buf */
+} rio_outq_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,6 +105,7 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#define CONNECT_DELAY 250  /* ms before open_clientfd tries the next address */
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -67,6 +114,23 @@ void dns_error(char *msg);
 void gai_error(int code, char *msg);
 void app_error(char *msg);
 
+/* Non-fatal errors: what the error-handling functions record for the
+   calling thread instead of exiting, once it called soft_errors(1) */
+#define ERR_UNIX  1            /* code is an errno value */
+#define ERR_POSIX 2            /* code is an errno value, returned */
+#define ERR_GAI   3            /* code is a getaddrinfo error */
+#define ERR_APP   4            /* no code */
+#define ERR_DNS   5            /* code is h_errno */
+typedef struct {
+    int kind;                  /* ERR_*, 0 if no error */
+    int code;                  /* Error code, depending on kind */
+    char msg[64];              /* Message of the wrapper that failed */
+} csapp_error_t;
+
+void soft_errors(int on);
+const csapp_error_t *last_error(void);
+void clear_error(void);
+
 /* Process control wrappers */
 pid_t Fork(void);
 void Execve(const char *filename, char *const argv[], char *const envp[]);
@@ -175,24 +239,56 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
-void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitb(rio_fixed_t *fp, int fd); 
+void rio_readinitb_sized(rio_t *rp, int fd, size_t size, size_t maxsize);
+void rio_releaseb(rio_t *rp);
+void rio_freeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_peeklineb(rio_t *rp, char **linep);
+void rio_consumeb(rio_t *rp, size_t n);
+ssize_t rio_writev(int fd, const struct iovec *iov, int iovcnt);
+int rio_writeinitb(rio_wbuf_t *wp, int fd, size_t size, int flags);
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+int rio_flushb(rio_wbuf_t *wp);
+void rio_freewb(rio_wbuf_t *wp);
+
+/* Non-blocking Rio package (for O_NONBLOCK descriptors) */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+void rio_outinitq(rio_outq_t *qp, int fd);
+ssize_t rio_writeq(rio_outq_t *qp, void *usrbuf, size_t n);
+ssize_t rio_flushq(rio_outq_t *qp);
+void rio_freeq(rio_outq_t *qp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
-void Rio_readinitb(rio_t *rp, int fd); 
+void Rio_readinitb(rio_fixed_t *fp, int fd); 
+void Rio_readinitb_sized(rio_t *rp, int fd, size_t size, size_t maxsize);
+void Rio_freeb(rio_t *rp);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_peeklineb(rio_t *rp, char **linep);
+void Rio_consumeb(rio_t *rp, size_t n);
+void Rio_writev(int fd, const struct iovec *iov, int iovcnt);
+void Rio_writeinitb(rio_wbuf_t *wp, int fd, size_t size, int flags);
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+void Rio_flushb(rio_wbuf_t *wp);
+void Rio_freewb(rio_wbuf_t *wp);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
 int open_listenfd(char *port);
+int open_listenfd_opts(char *port, const listen_opts_t *opts);
+int accept_batch(int listenfd, int *connfds, int max, int flags);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
+int Open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
 int Open_listenfd(char *port);
+int Open_listenfd_opts(char *port, const listen_opts_t *opts);
+int Accept_batch(int listenfd, int *connfds, int max, int flags);
 
 
 #endif /* __CSAPP_H__ */
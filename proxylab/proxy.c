@@ -8,24 +8,31 @@
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define MAXURI 1024
+#define ACCEPT_BATCH 64
+#define CONNECT_TIMEOUT 5000 /* ms to reach the server */
 
 void *serve(void *connfdp);
 void proxy(int connfd);
 void parse_uri(char *uri, char **host, char **port, char **path);
-void forward_header(rio_t *rio, int connfd, char *uri);
+void forward_header(rio_t *rio, int connfd, char *uri, char *request);
 void forward_response(rio_t *rio, int connfd, char *uri, char *path);
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
 static cache_t cache;
 static pthread_rwlock_t rwlock;
 
 int main(int argc, char* argv[]) {
     int listenfd;
     int *client_fdp;
+    int client_fds[ACCEPT_BATCH];
+    int i, n;
 
-    socklen_t client_len;
-    struct sockaddr client_addr;
+    /* a deep backlog and a batched accept absorb connection storms;
+       clients send their request first, so they can wait in the kernel */
+    listen_opts_t opts = { .backlog = 4096, .defer_accept = 5, .nodelay = 1, .nonblock = 1 };
     pthread_t tid;
 
     if (argc != 2) {
@@ -35,14 +42,17 @@ int main(int argc, char* argv[]) {
 
     cache_init(&cache);
     pthread_rwlock_init(&rwlock, NULL);
+    Signal(SIGPIPE, SIG_IGN); /* a closed peer is an EPIPE error instead */
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd_opts(argv[1], &opts);
 
     while(1) {
-        client_len = sizeof(client_addr);
-        client_fdp = Malloc(sizeof(int));
-        *client_fdp = Accept(listenfd, &client_addr, &client_len);
-        Pthread_create(&tid, NULL, serve, (void *)client_fdp);
+        n = Accept_batch(listenfd, client_fds, ACCEPT_BATCH, SOCK_CLOEXEC);
+        for (i = 0; i < n; i++) {
+            client_fdp = Malloc(sizeof(int));
+            *client_fdp = client_fds[i];
+            Pthread_create(&tid, NULL, serve, (void *)client_fdp);
+        }
     }
     return 0;
 }
@@ -51,6 +61,9 @@ void *serve(void *client_fdp) {
 	int client_fd = *((int *)client_fdp);
 	Pthread_detach(Pthread_self());
 	Free(client_fdp);
+	/* an error (say, a client resetting its connection) only ends this
+	   connection, not the proxy */
+	soft_errors(1);
 	proxy(client_fd);
 	Close(client_fd);
 	return NULL;
@@ -68,8 +81,10 @@ void proxy(int client_fd) {
     char *path;
     int server_fd;
 
-    Rio_readinitb(&client_rio, client_fd);
-    if (!Rio_readlineb(&client_rio, buf, MAXBUF)) {
+    /* requests are small; responses get a buffer that grows with them */
+    Rio_readinitb_sized(&client_rio, client_fd, 2 * RIO_MINBUFSIZE, RIO_BUFSIZE);
+    if (Rio_readlineb(&client_rio, buf, MAXBUF) <= 0) {
+        Rio_freeb(&client_rio);
         return; /* reading client request failed */
     }
     sscanf(buf, "%s %s %s", http_method, uri, http_version);
@@ -83,21 +98,27 @@ void proxy(int client_fd) {
         /* if cache hit */
         Rio_writen(client_fd, temp_node->obj, temp_node->obj_size);
         pthread_rwlock_unlock(&rwlock);
+        Rio_freeb(&client_rio);
         return;
     }
     pthread_rwlock_unlock(&rwlock);
 
-    server_fd = Open_clientfd(host, port);
-    Rio_readinitb(&server_rio, server_fd);
+    if ((server_fd = open_clientfd_timeout(host, port, CONNECT_TIMEOUT)) < 0) {
+        Rio_freeb(&client_rio);
+        return; /* server unreachable: drop this request only */
+    }
+    Rio_readinitb_sized(&server_rio, server_fd, RIO_BUFSIZE, RIO_MAXBUFSIZE);
 
     sprintf(buf, "GET /%s HTTP/1.0\r\n", path);
-    Rio_writen(server_fd, buf, strlen(buf));
 
-    /* send headers */
-    forward_header(&client_rio, server_fd, host);
+    /* send request line and headers */
+    forward_header(&client_rio, server_fd, host, buf);
+    Rio_freeb(&client_rio);
 
     /* receive response */
     forward_response(&server_rio, client_fd, uri, path);
+    Rio_freeb(&server_rio);
+    Close(server_fd);
 }
 
 void parse_uri(char *uri, char **host, char **port, char **path) {
@@ -117,52 +138,87 @@ void parse_uri(char *uri, char **host, char **port, char **path) {
     return;
 }
 
-void forward_header(rio_t *rio, int connfd, char *host) {
-    char buf[MAX_OBJECT_SIZE];
+/* header lines are looked at where they sit in the rio buffer, and only
+   copied once, into the request sent upstream */
+static int has_prefix(const char *line, size_t size, const char *prefix) {
+    size_t len = strlen(prefix);
+
+    return size >= len && !strncmp(line, prefix, len);
+}
+
+static void append(char *header, size_t *read, const char *line, size_t size) {
+    if (*read + size <= MAX_OBJECT_SIZE - 2) { /* room for the final \r\n */
+        memcpy(header + *read, line, size);
+        *read += size;
+    }
+}
+
+void forward_header(rio_t *rio, int connfd, char *host, char *request) {
+    char buf[MAXLINE];
     char header[MAX_OBJECT_SIZE];
+    char *line;
     int host_header_exists = 0;
+    struct iovec iov[2];
 
-    size_t size = 0;
+    ssize_t size = 0;
     size_t read = 0;
 
-    while ((size = Rio_readlineb(rio, buf, MAXBUF))) {
-		if (!strncmp(buf, "\r\n", 2)) {
+    while ((size = Rio_peeklineb(rio, &line)) > 0) {
+        if (has_prefix(line, size, "\r\n")) {
+            Rio_consumeb(rio, size);
             break;
         }
-        if (strstr(buf, "Connection:") == buf) {
-            sprintf(buf, "Connection: close\r\n");
-        } else if (strstr(buf, "Proxy-Connection:") == buf) {
-            sprintf(buf, "Proxy-Connection: close\r\n");
-        } else if (strstr(buf, "Host:") == buf) {
-            host_header_exists = 1;
+        if (has_prefix(line, size, "Connection:")) {
+            append(header, &read, connection_hdr, strlen(connection_hdr));
+        } else if (has_prefix(line, size, "Proxy-Connection:")) {
+            append(header, &read, proxy_connection_hdr, strlen(proxy_connection_hdr));
+        } else {
+            if (has_prefix(line, size, "Host:")) {
+                host_header_exists = 1;
+            }
+            append(header, &read, line, size);
         }
-        strcat(header, buf);
-        read += size;
+        Rio_consumeb(rio, size);
 	}
 
     if (!host_header_exists) {
-        sprintf(buf, "Host: %s\r\n", host);
-        strcat(header, buf);
-        read += size;
+        snprintf(buf, sizeof(buf), "Host: %s\r\n", host);
+        append(header, &read, buf, strlen(buf));
     }
-    strcat(header, "\r\n");
-    Rio_writen(connfd, header, read);
+    memcpy(header + read, "\r\n", 2);
+    read += 2;
+
+    /* request line and headers in one system call */
+    iov[0].iov_base = request;
+    iov[0].iov_len = strlen(request);
+    iov[1].iov_base = header;
+    iov[1].iov_len = read;
+    Rio_writev(connfd, iov, 2);
 }
 
 void forward_response(rio_t *rio, int connfd, char *uri, char *path){
-	char buf[MAX_OBJECT_SIZE];
     char payload[MAX_OBJECT_SIZE];
+    char *line;
+    rio_wbuf_t out;
 
-    size_t size = 0;
+    ssize_t size = 0;
     size_t read = 0;
 
-	while ((size = Rio_readlineb(rio, buf, MAX_OBJECT_SIZE))) {
-		Rio_writen(connfd, buf, size);
+    /* lines are collected and sent a buffer at a time */
+    Rio_writeinitb(&out, connfd, MAXBUF, RIO_MSGMORE);
+	while (!last_error() && (size = Rio_peeklineb(rio, &line)) > 0) {
+		Rio_writenb(&out, line, size);
         if (read + size <= MAX_OBJECT_SIZE) {
-            memcpy(payload + read, buf, size);
+            memcpy(payload + read, line, size);
         }
         read += size;
+        Rio_consumeb(rio, size);
 	}
+    Rio_flushb(&out);
+    Rio_freewb(&out);
+    if (last_error()) {
+        return; /* don't cache a response cut short */
+    }
 
     pthread_rwlock_wrlock(&rwlock);
     node_init(&cache, uri, path, payload, read);
@@ -0,0 +1,140 @@
+/*
+ * rio_bench - Microbenchmark for rio_readlineb
+ *
+ * Reads a file of HTTP-style header lines through rio_readlineb and
+ * through the original byte-at-a-time version (kept here as
+ * readlineb_bytewise), and prints lines/sec and MB/sec for both. The
+ * input is an unlinked temporary file that stays in the page cache, so
+ * the read() calls are cheap and the cost of the line scanning dominates.
+ *
+ * Build: gcc -O2 -o rio_bench rio_bench.c csapp.c -lpthread
+ * Usage: rio_bench [lines]
+ */
+#include "csapp.h"
+#include <time.h>
+
+#define DEFAULT_LINES 2000000
+#define ROUNDS        5
+
+static const char *headers[] = {
+    "GET http://www.example.com:8080/index.html HTTP/1.0\r\n",
+    "Host: www.example.com:8080\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+    "Accept-Encoding: gzip, deflate\r\n",
+    "Connection: close\r\n",
+    "Proxy-Connection: close\r\n",
+    "\r\n",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The rio_read of csapp.c, which the byte-at-a-time version relies on */
+static ssize_t bench_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR)
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;
+    if (rp->rio_cnt < n)
+	cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/* readlineb_bytewise - rio_readlineb as it was before the memchr scan */
+static ssize_t readlineb_bytewise(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = bench_read(rp, &c, 1)) == 1) {
+	    *bufp++ = c;
+	    if (c == '\n') {
+                n++;
+		break;
+            }
+	} else if (rc == 0) {
+	    if (n == 1)
+		return 0;
+	    else
+		break;
+	} else
+	    return -1;
+    }
+    *bufp = 0;
+    return n-1;
+}
+
+static void bench(const char *name, int fd, long nlines,
+		  ssize_t (*readline)(rio_t *, void *, size_t))
+{
+    rio_fixed_t rio;
+    char buf[MAXLINE];
+    double start, best = 0;
+    long lines;
+    size_t bytes;
+    ssize_t n;
+    int r;
+
+    for (r = 0; r < ROUNDS; r++) {
+	Lseek(fd, 0, SEEK_SET);
+	rio_readinitb(&rio, fd);
+	lines = bytes = 0;
+	start = now();
+	while ((n = readline(&rio.rio, buf, MAXLINE)) > 0) {
+	    lines++;
+	    bytes += n;
+	}
+	if (n < 0)
+	    unix_error("readline error");
+	if (r == 0 || now() - start < best)
+	    best = now() - start;
+    }
+    if (lines != nlines)
+	app_error("line count mismatch");
+
+    printf("%-12s %10.0f lines/s %8.1f MB/s\n", name, lines / best,
+	   bytes / best / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    long nlines = argc > 1 ? atol(argv[1]) : DEFAULT_LINES;
+    int nheaders = sizeof(headers) / sizeof(headers[0]);
+    FILE *fp;
+    long i;
+    int fd;
+
+    if (!(fp = tmpfile()))
+	unix_error("tmpfile error");
+    fd = fileno(fp);
+    for (i = 0; i < nlines; i++)
+	Rio_writen(fd, (void *)headers[i % nheaders],
+		   strlen(headers[i % nheaders]));
+
+    printf("%ld lines, best of %d rounds\n", nlines, ROUNDS);
+    bench("bytewise", fd, nlines, readlineb_bytewise);
+    bench("memchr", fd, nlines, rio_readlineb);
+    Fclose(fp);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# bench_builtins.sh - Measure how fast tsh runs a script of trivial
+#     commands with its in-process builtins, against the same script
+#     calling the external programs by absolute path (fork+exec each).
+#
+# usage: ./bench_builtins.sh [nrounds]
+#
+
+TSH=${TSH:-./tsh}
+N=${1:-1000}
+BUILTIN=$(mktemp)
+EXTERNAL=$(mktemp)
+
+# where the program is on PATH (command -v names the sh builtin instead)
+path_of() {
+    IFS=:
+    for dir in $PATH; do
+        if [ -x "$dir/$1" ]; then
+            echo "$dir/$1"
+            break
+        fi
+    done
+    unset IFS
+}
+
+# a typical script line mix: echo, printf, test, cd, pwd, true (cd stays
+# a builtin in both, it has to)
+i=0
+while [ $i -lt $N ]; do
+    cat >> $BUILTIN <<EOT
+echo round $i
+printf '%s %d\n' round $i
+test $i -ge 0 && true
+[ -d /tmp ]
+cd /tmp
+pwd
+EOT
+    i=$((i + 1))
+done
+sed -e "s#^echo#$(path_of echo)#" -e "s#^printf#$(path_of printf)#" \
+    -e "s#^test#$(path_of test)#" -e "s#&& true#\&\& $(path_of true)#" \
+    -e "s#^\[#$(path_of [)#" -e "s#^pwd#$(path_of pwd)#" $BUILTIN > $EXTERNAL
+LINES=$(wc -l < $BUILTIN)
+
+for script in $EXTERNAL $BUILTIN; do
+    if [ $script = $BUILTIN ]; then kind=builtins; else kind=external; fi
+    start=$(date +%s.%N)
+    $TSH -p < $script > /dev/null
+    end=$(date +%s.%N)
+    awk -v n=$LINES -v s=$start -v e=$end -v k=$kind \
+        'BEGIN { printf "%d lines with %s: %.3f s, %.0f lines/sec\n", n, k, e - s, n / (e - s) }'
+done
+
+rm -f $BUILTIN $EXTERNAL
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# bench_launch.sh - Measure how many foreground commands tsh launches per
+#     second, with posix_spawn (default) and with fork+execve (-f).
+#
+# usage: ./bench_launch.sh [ncommands] [command]
+#
+
+TSH=${TSH:-./tsh}
+N=${1:-5000}
+CMD=${2:-/bin/true}
+SCRIPT=$(mktemp)
+
+i=0
+while [ $i -lt $N ]; do
+    echo "$CMD" >> $SCRIPT
+    i=$((i + 1))
+done
+
+for mode in "" "-f"; do
+    start=$(date +%s.%N)
+    $TSH -p $mode < $SCRIPT > /dev/null
+    end=$(date +%s.%N)
+    awk -v n=$N -v s=$start -v e=$end -v m="${mode:-(posix_spawn)}" \
+        'BEGIN { printf "%d commands %s: %.0f cmds/sec\n", n, m, n / (e - s) }'
+done
+
+rm -f $SCRIPT
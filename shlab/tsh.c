@@ -3,6 +3,7 @@
  * 
  * <Put your student number and login ID here>
  */
+#define _GNU_SOURCE /* pipe2 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,12 +16,27 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXLINE    1024   /* max job command line size shown */
+#define MAXJOBS      16   /* initial job table size, grows as needed */
 #define MAXJID    1<<16   /* max job ID */
+#define HASHSIZE    256   /* buckets in the command hash table */
+#define BUILTINHASH  64   /* buckets in the builtin command table */
+#define MAXNOTICES   64   /* BG job completions waiting for the prompt */
+#define INBUFSIZE 65536   /* initial size of the input buffer */
+#define MAXSTAGES    16   /* max commands in a pipeline */
+#define NMILESTONES   5   /* points of a job's startup timeline (-P) */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -28,6 +44,17 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Token types */
+#define T_WORD   0 /* a word, quotes removed and variables expanded */
+#define T_PIPE   1 /* | */
+#define T_AND    2 /* && */
+#define T_OR     3 /* || */
+#define T_SEMI   4 /* ; */
+#define T_AMP    5 /* & */
+#define T_IN     6 /* < */
+#define T_OUT    7 /* > */
+#define T_APPEND 8 /* >> */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -42,16 +69,176 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
+int use_fork = 0;           /* if true, launch jobs with fork+execve */
+int event_mode = 0;         /* if true, reap children from a signalfd */
+int sigchld_fd = -1;        /* the signalfd, SIGCHLD blocked for good */
+sigset_t child_mask;        /* signal mask given to jobs in event mode */
+int batch_slots = 0;        /* if > 0, run the script with this many jobs at once */
+int batch_failed = 0;       /* set when a batch job fails */
+int *batch_done = NULL;     /* ring of finished batch jobs' outputs, batch_slots big */
+int batch_head = 0;         /* next output to print */
+int batch_tail = 0;         /* next output to fill (SIGCHLD handler) */
+int account_all = 0;        /* if true, report resource usage of every job */
+volatile sig_atomic_t last_status = 0; /* exit status of the last FG job, $? */
+volatile sig_atomic_t last_killed = 0;  /* a signal ended the last FG job */
+int cgroup_root = -1;       /* -c: cgroup v2 directory holding the jobs' cgroups */
+char *cgroup_cpu = NULL;    /* -C: cpu.max of each job's cgroup, or NULL */
+char *cgroup_mem = NULL;    /* -M: memory.max of each job's cgroup, or NULL */
+int cgroup_seq = 0;         /* number of job cgroups made so far */
+int tag_output = 0;         /* -o: tag BG jobs' output, report them at the prompt */
+int out_epfd = -1;          /* epoll instance watching the BG jobs' output */
+int out_tty = 0;            /* stdout is a terminal: flush after every line */
+int profile = 0;            /* -P: time the startup of FG jobs */
+int prof_sigfd = -1;        /* signalfd for SIGCHLD while a profiled job runs */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (process group ID, first stage) */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
+    int nstages;            /* number of processes in the pipeline */
+    int nalive;             /* processes not reaped yet */
+    int termsig;            /* first signal that killed a stage, 0 if none */
+    int exitstatus;         /* exit status of the last stage */
+    int lastsig;            /* signal that killed the last stage, 0 if it exited */
+    int outfd;              /* captured output (batch mode), -1 if none */
+    int timed;              /* report resource usage when done */
+    struct timespec start;  /* when the job was started */
+    struct timeval utime;   /* user time of the reaped processes */
+    struct timeval stime;   /* system time of the reaped processes */
+    long maxrss;            /* largest max RSS (KB) of the reaped processes */
+    int cgfd;               /* directory of the job's cgroup, -1 if none */
+    int cgid;               /* its sequence number */
+    pid_t pids[MAXSTAGES];  /* stage PIDs, 0 once reaped */
     char cmdline[MAXLINE];  /* command line */
+    struct job_t *next;     /* next free job struct */
+};
+
+struct pidslot_t {          /* A slot of the pid -> job hash table */
+    pid_t pid;              /* 0 if empty, -1 if deleted */
+    struct job_t *job;
+};
+
+struct jobs_t {             /* The job list */
+    struct job_t **byjid;   /* jid -> job, NULL if unused */
+    int jidcap;             /* size of byjid */
+    int maxjid;             /* largest allocated job ID */
+    struct pidslot_t *bypid;/* pid -> job, open addressing */
+    int pidcap;             /* size of bypid, a power of 2 */
+    int pidused;            /* slots live or deleted */
+    int nprocs;             /* slots live */
+    int nrunning;           /* jobs in the FG or BG state */
+    struct job_t *freelist; /* job structs ready for reuse */
+    struct job_t *fgjob;    /* the FG job, NULL if none */
+    volatile sig_atomic_t fgpid; /* its PID, read by signal handlers */
+};
+struct jobs_t jobs;         /* The job list */
+
+struct cmdhash_t {          /* A command hash table entry */
+    char *name;             /* command name as typed */
+    char *path;             /* resolved absolute path */
+    int hits;               /* number of times used */
+    struct cmdhash_t *next; /* next entry in the bucket */
+};
+struct cmdhash_t *cmdhash[HASHSIZE]; /* command name -> path cache */
+char *hashed_path = NULL;   /* PATH the cache was built against */
+
+struct builtin_t {          /* A builtin command */
+    char *name;             /* its name */
+    int (*fn)(char **argv); /* runs it in the shell, returns the exit status */
+    struct builtin_t *next; /* next in the hash bucket */
+};
+struct builtin_t *builtins[BUILTINHASH]; /* name -> builtin */
+
+struct stream_t {           /* Output of a BG job read through a pipe (-o) */
+    int fd;                 /* read end of the pipe */
+    int jid;                /* the job's ID, to tag the lines with */
+    int len;                /* bytes of the unfinished line in buf */
+    char buf[MAXLINE];      /* unfinished line */
+};
+
+struct notice_t {           /* A BG job completion to report (-o) */
+    char msg[MAXLINE];      /* the message */
+};
+struct notice_t notices[MAXNOTICES]; /* ring filled by the SIGCHLD handler */
+int notice_head = 0;        /* next notice to print */
+int notice_tail = 0;        /* next notice to fill */
+
+struct inbuf_t {            /* The shell's input, read in blocks */
+    char *buf;              /* bytes read from stdin */
+    int cap;                /* size of buf */
+    int start;              /* first byte not handed out yet */
+    int end;                /* end of the bytes read */
+};
+struct inbuf_t inbuf;       /* stdin */
+
+struct cache_t {            /* A "cached" job being run for the cache */
+    char entry[MAXLINE];    /* cache entry its output goes to */
+    char tmp[MAXLINE];      /* file capturing its output, "" if not cached */
+    char *outfile;          /* where its output was going, NULL: stdout */
+    int append;             /* outfile given with >> */
+};
+
+struct profile_t {          /* Startup timeline of a FG job (-P) */
+    struct timespec start;  /* just before its first stage was started */
+    long us[NMILESTONES];   /* microseconds from start to each milestone, -1: never */
+    int exec_fd;            /* pipe hitting EOF once every stage exec'd */
+    int exec_w;             /* its write end, until the stages are started */
+    int out_fd;             /* pipe the last stage's stdout goes through */
+    int out_w;              /* its write end, until the stages are started */
+    int pidfds[MAXSTAGES];  /* the stages' pidfds, -1 once exited */
+    int npidfds;
+};
+struct profile_t *prof_job = NULL; /* the job start_job starts, if profiled */
+
+char *milestones[NMILESTONES] = { /* what the timeline of a job records */
+    "spawned",              /* fork/posix_spawn returned for every stage */
+    "exec'd",               /* every stage exec'd */
+    "first output",         /* first byte on its stdout */
+    "exited",               /* its last stage exited */
+    "reaped",               /* the shell reaped it */
+};
+long *prof_samples[NMILESTONES]; /* the timelines of all profiled jobs */
+int prof_nsamples = 0;
+int prof_cap = 0;
+
+struct cmd_t {              /* One stage of a pipeline */
+    char **argv;            /* arguments, NULL terminated */
+    char *infile;           /* < redirection, or NULL */
+    char *outfile;          /* > or >> redirection, or NULL */
+    int append;             /* outfile given with >> */
+    int in_fd;              /* descriptor to use as stdin */
+    int out_fd;             /* descriptor to use as stdout */
+    int err_fd;             /* descriptor to use as stderr */
+    int cg_fd;              /* cgroup.procs to join before exec, -1 if none */
+};
+
+struct token_t {            /* A token of the command line */
+    int type;               /* T_WORD or an operator */
+    int word;               /* T_WORD: offset of the word in the parse buffer */
+    int start, end;         /* where it is in the command line */
+};
+
+struct pipeline_t {         /* One pipeline of a command list */
+    struct cmd_t *cmds;     /* its stages */
+    int ncmds;              /* number of stages */
+    int bg;                 /* ended by & */
+    int cond;               /* T_SEMI, T_AND or T_OR: run after the previous one */
+    int start, end;         /* where it is in the command line */
+};
+
+struct parse_t {            /* Parser state, reused line after line */
+    char *buf;              /* the words, NUL terminated */
+    int len, bufcap;
+    struct token_t *toks;   /* the tokens */
+    int ntoks, tokcap;
+    char **argv;            /* the argv arrays of the stages */
+    int argcap;
+    struct cmd_t *cmds;     /* the stages */
+    int cmdcap;
+    struct pipeline_t pl;   /* the pipeline parsed last */
+    int cond;               /* operator that ended it */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
 /* End global variables */
 
 
@@ -59,28 +246,81 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
-int builtin_cmd(char **argv);
+char *read_cmdline(void);
+int builtin_cmd(struct cmd_t *cmd);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
+void do_wait(void);
+int time_builtin(struct cmd_t *cmd);
+pid_t start_job(struct cmd_t *cmds, int ncmds, int state, char *cmdline, int outfd, const sigset_t *child_mask);
+void run_batch(void);
+pid_t launch_cmd(struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask);
+pid_t spawn_cmd(const char *path, struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask);
+pid_t fork_cmd(const char *path, struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask);
+void block_sigchld(sigset_t *prev_mask);
+void unblock_sigchld(const sigset_t *prev_mask);
+void sleep_sigchld(const sigset_t *prev_mask);
+void reap_children(void);
+void dump_output(int fd);
+void dump_finished(void);
+void print_usage(char *prefix, long real_ms, struct timeval *utime, struct timeval *stime, long maxrss);
+void report_job_usage(struct job_t *job);
+void init_event_mode(void);
+void drain_sigchld_fd(void);
+void wait_input(void);
+void init_tag_output(void);
+void add_stream(int fd, int jid);
+void drain_streams(int timeout, const sigset_t *mask);
+void report_bg(void);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parse_pipeline(struct parse_t *p, const char *cmdline, int *pos);
+void pipeline_text(char *buf, const char *cmdline, struct pipeline_t *pl);
+void run_pipeline(const char *cmdline, struct pipeline_t *pl);
+int open_redirects(struct cmd_t *cmd);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct jobs_t *jobs);
+int maxjid(struct jobs_t *jobs); 
+void setjobstate(struct jobs_t *jobs, struct job_t *job, int state);
+int addjob(struct jobs_t *jobs, pid_t pid, int state, char *cmdline);
+void addstage(struct jobs_t *jobs, struct job_t *job, pid_t pid);
+int removestage(struct jobs_t *jobs, struct job_t *job, pid_t pid);
+int deletejob(struct jobs_t *jobs, pid_t pid); 
+pid_t fgpid(struct jobs_t *jobs);
+struct job_t *getjobpid(struct jobs_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct jobs_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct jobs_t *jobs, int long_format);
+
+char *find_cmd(char *name);
+int hash_remove(char *name);
+void hash_clear(void);
+void do_hash(char **argv);
+
+void init_builtins(void);
+struct builtin_t *find_builtin(char *name);
+
+void init_cgroups(char *path);
+int cgroup_create(int *id);
+void cgroup_remove(int id);
+void cgroup_sweep(void);
+void cgroup_kill(struct job_t *job);
+void cgroup_usage(struct job_t *job);
+
+int cache_lookup(struct pipeline_t *pl, struct cache_t *cache);
+void cache_store(struct cache_t *cache, pid_t pgid);
+
+void init_profile(void);
+void profile_setup(struct profile_t *prof);
+void profile_started(struct profile_t *prof, pid_t *pids, int npids);
+void profile_wait(struct profile_t *prof, pid_t pgid);
+void profile_report(void);
 
 void usage(void);
 void unix_error(char *msg);
@@ -95,6 +335,7 @@ pid_t wrap_fork(void);
 int wrap_execve(const char *filename, char *const argv[], char *const envp[]);
 pid_t wrap_wait(int *status);
 pid_t wrap_waitpid(pid_t pid, int *iptr, int options);
+pid_t wrap_wait4(pid_t pid, int *iptr, int options, struct rusage *ru);
 void wrap_kill(pid_t pid, int signum);
 unsigned int wrap_sleep(unsigned int secs);
 void wrap_setpgid(pid_t pid, pid_t pgid);
@@ -115,7 +356,7 @@ ssize_t sio_puts(char s[]);
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
@@ -123,7 +364,10 @@ int main(int argc, char **argv)
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    char *cgroup_path = NULL;
+    static char cpu_max[32];
+
+    while ((c = getopt(argc, argv, "hvpfeaoPj:c:C:M:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -134,6 +378,39 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'f':             /* launch jobs with fork+execve */
+            use_fork = 1;     /* for comparison against posix_spawn */
+	    break;
+        case 'e':             /* process child status changes synchronously */
+            event_mode = 1;   /* from a signalfd instead of the handler */
+	    break;
+        case 'a':             /* report resource usage of every job */
+            account_all = 1;
+	    break;
+        case 'o':             /* tag BG jobs' output, notify at the prompt */
+            tag_output = 1;
+	    break;
+        case 'P':             /* time the startup of FG jobs */
+            profile = 1;
+	    break;
+        case 'j':             /* run stdin as a batch script */
+            if ((batch_slots = atoi(optarg)) < 1) {
+                usage();
+            }
+	    break;
+        case 'c':             /* run each job in a cgroup of its own */
+            cgroup_path = optarg;
+	    break;
+        case 'C':             /* CPU limit of each job, percent of a CPU */
+            if (atoi(optarg) < 1) {
+                usage();
+            }
+            snprintf(cpu_max, sizeof(cpu_max), "%d 100000", atoi(optarg) * 1000);
+            cgroup_cpu = cpu_max;
+	    break;
+        case 'M':             /* memory limit of each job, e.g. 512M */
+            cgroup_mem = optarg;
+	    break;
 	default:
             usage();
 	}
@@ -149,33 +426,121 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
+    /* the shell's own output only needs flushing line by line for a
+       terminal; otherwise it is flushed before anything else writes */
+    out_tty = isatty(STDOUT_FILENO);
+
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs(&jobs);
+    init_builtins();
+
+    if (event_mode) {
+        init_event_mode();
+    }
+
+    if (tag_output) {
+        init_tag_output();
+    }
+
+    if (profile) {
+        init_profile();
+    }
+
+    if (cgroup_path) {
+        init_cgroups(cgroup_path);
+    } else if (cgroup_cpu || cgroup_mem) {
+        usage();              /* limits need -c */
+    }
+
+    if (batch_slots) {
+        run_batch(); /* does not return */
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
 	/* Read command line */
+	if (tag_output) {
+	    report_bg(); /* BG output and completions since the last prompt */
+	}
 	if (emit_prompt) {
 	    printf("%s", prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
-	    fflush(stdout);
+	if (event_mode || tag_output) {
+	    wait_input(); /* handle child events until a line can be read */
+	}
+	if ((cmdline = read_cmdline()) == NULL) {
+	    if (tag_output)
+		report_bg();
+	    fflush(stdout); /* End of file (ctrl-d) */
 	    exit(0);
 	}
 
 	/* Evaluate the command line */
 	eval(cmdline);
-	fflush(stdout);
-	fflush(stdout);
+	if (out_tty)
+	    fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
   
+/*
+ * read_cmdline - Return the next line of input, its newline replaced by a
+ *    NUL, or NULL at EOF. The input is read in blocks of INBUFSIZE or more
+ *    and the lines are handed out (and parsed) right where they are in the
+ *    buffer, so a script costs a read per block and no copy per line. The
+ *    buffer grows for a line that doesn't fit.
+ */
+char *read_cmdline(void)
+{
+    char *line, *nl;
+    ssize_t n;
+
+    while (1) {
+        if (inbuf.end > inbuf.start &&
+            (nl = memchr(inbuf.buf + inbuf.start, '\n', inbuf.end - inbuf.start))) {
+            line = inbuf.buf + inbuf.start;
+            *nl = '\0';
+            inbuf.start = nl + 1 - inbuf.buf;
+            return line;
+        }
+
+        /* no whole line left: keep the partial one, read more after it */
+        if (inbuf.start > 0) {
+            memmove(inbuf.buf, inbuf.buf + inbuf.start, inbuf.end - inbuf.start);
+            inbuf.end -= inbuf.start;
+            inbuf.start = 0;
+        }
+        if (inbuf.end + 1 >= inbuf.cap) {
+            inbuf.cap = inbuf.cap ? 2 * inbuf.cap : INBUFSIZE;
+            if (!(inbuf.buf = realloc(inbuf.buf, inbuf.cap))) {
+                unix_error("realloc error");
+            }
+        }
+        /* about to block: what eval printed goes out before anything the
+           SIGCHLD handler writes straight to fd 1 meanwhile */
+        fflush(stdout);
+        if ((n = read(STDIN_FILENO, inbuf.buf + inbuf.end, inbuf.cap - inbuf.end - 1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("read error");
+        }
+        if (n == 0) {
+            if (inbuf.end == inbuf.start) {
+                return NULL;
+            }
+            inbuf.buf[inbuf.end] = '\0'; /* last line without a newline */
+            line = inbuf.buf + inbuf.start;
+            inbuf.start = inbuf.end;
+            return line;
+        }
+        inbuf.end += n;
+    }
+}
+
 /* 
  * eval - Evaluate the command line that the user has just typed in
  * 
@@ -189,465 +554,3128 @@ int main(int argc, char **argv)
 */
 void eval(char *cmdline) 
 {
-    int bg;
-    int pid;
-    sigset_t mask;
-    char *argv[MAXARGS];
+    static struct parse_t parse; /* grows to the longest line seen */
+    struct pipeline_t *pl = &parse.pl;
+    int pos = 0;
+    int rc;
+
+    /* a && b runs b if a succeeded, a || b if it failed; skipped
+       pipelines leave $? alone */
+    while ((rc = parse_pipeline(&parse, cmdline, &pos)) > 0) {
+        if ((pl->cond == T_AND && last_status != 0) || (pl->cond == T_OR && last_status == 0)) {
+            continue;
+        }
+        run_pipeline(cmdline, pl);
+    }
+    if (rc < 0) {
+        last_status = 2;
+    }
+}
 
-    bg = parseline(cmdline, argv);
+/*
+ * run_pipeline - Run one pipeline of the command line: a builtin right
+ *    away, anything else as a job, waiting for it unless it ends in &.
+ *    Sets last_status.
+ */
+void run_pipeline(const char *cmdline, struct pipeline_t *pl)
+{
+    int timed, cached;
+    pid_t pgid;
+    sigset_t prev_mask;
+    char text[MAXLINE];
+    int pipefd[2] = { -1, -1 };
+    struct cmd_t *cmds = pl->cmds;
+    struct cache_t cache;
+    struct profile_t prof;
+
+    /* "time cmd ..." reports the resource usage of the job */
+    if ((timed = !strcmp(cmds[0].argv[0], "time"))) {
+        if (!*++cmds[0].argv) {
+            if (pl->ncmds > 1) {
+                printf("syntax error: missing command\n");
+            }
+            return;
+        }
+    }
 
-    if (argv[0] == NULL) { //terminate on EOF
-        return;
+    /* "cached cmd ..." replays the output of an identical earlier run */
+    if ((cached = !strcmp(cmds[0].argv[0], "cached"))) {
+        if (!*++cmds[0].argv) {
+            if (pl->ncmds > 1) {
+                printf("syntax error: missing command\n");
+            }
+            return;
+        }
     }
 
-    if (builtin_cmd(argv)) { //if it is a built-in-command: execute it and return 1. else return 0.
+    if (pl->ncmds == 1 && (timed ? time_builtin(&cmds[0]) : builtin_cmd(&cmds[0]))) { //if it is a built-in-command: execute it and return 1. else return 0.
         return;
     }
 
-    wrap_sigemptyset(&mask);
-    wrap_sigaddset(&mask, SIGCHLD);
-
-    wrap_sigprocmask(SIG_BLOCK, &mask, NULL); //mask SIGCHLD 
+    if (cached && !pl->bg) {
+        if (cache_lookup(pl, &cache)) {
+            return;           /* hit: output replayed, last_status set */
+        }
+        cached = (cache.tmp[0] != '\0');
+    } else {
+        cached = 0;           /* a BG job's output can't wait for its end */
+    }
 
-    if ((pid = wrap_fork()) == 0) {
-        // Child's behavior
-        setpgid(0, 0);
-        wrap_sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        
-        if (execve(argv[0], argv, environ) < 0) {
-            printf("%s: Command not found\n", argv[0]);
-            exit(0);
+    pipeline_text(text, cmdline, pl);
+    if (pl->bg && tag_output && pipe2(pipefd, O_CLOEXEC) < 0) {
+        unix_error("Pipe error"); /* the job's output, read by the shell */
+    }
+    if (profile && !pl->bg) {
+        profile_setup(&prof);
+        prof_job = &prof;
+    }
+    block_sigchld(&prev_mask); //mask SIGCHLD 
+
+    pgid = start_job(cmds, pl->ncmds, pl->bg ? BG : FG, text, pipefd[1], &prev_mask);
+    prof_job = NULL;
+    if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+        if (pgid) {
+            getjobpid(&jobs, pgid)->outfd = -1; /* a pipe, not a memfd to dump */
+            add_stream(pipefd[0], pid2jid(pgid));
+        } else {
+            close(pipefd[0]);
         }
     }
+    if (!pgid) {
+        unblock_sigchld(&prev_mask);
+        last_status = 127;
+        if (profile && !pl->bg) {
+            close(prof.exec_fd);
+            close(prof.out_fd);
+            if (prof.exec_w >= 0) { /* no stage was even tried */
+                close(prof.exec_w);
+                close(prof.out_w);
+            }
+        }
+        if (cached) {
+            unlink(cache.tmp);
+        }
+        return;
+    }
+    getjobpid(&jobs, pgid)->timed = timed;
 
     // Parent's behavior
-    if (!bg) {
-        addjob(jobs, pid, FG, cmdline);
-        wrap_sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        waitfg(pid); /* wait for the foreground job to finish */
-    } else {
-        addjob(jobs, pid, BG, cmdline); 
-        wrap_sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        printf("[%d] (%d) %s", pid2jid(pid), (int)pid, cmdline); /* print out log and execute in background */
+    if (pl->bg) {
+        /* while SIGCHLD is blocked, a short job can't be gone already */
+        printf("[%d] (%d) %s", pid2jid(pgid), (int)pgid, text); /* print out log and execute in background */
+        fflush(stdout);
+        last_status = 0;
     }
+    unblock_sigchld(&prev_mask);
 
-    return;
-}
-
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
- */
-int parseline(const char *cmdline, char **argv) 
-{
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
-    }
-
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
-
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
-	}
-	else {
-	    delim = strchr(buf, ' ');
-	}
+    if (!pl->bg && profile) {
+        profile_wait(&prof, pgid);
+    } else if (!pl->bg) {
+        waitfg(pgid); /* wait for the foreground job to finish */
     }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
-
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
+    if (cached) {
+        cache_store(&cache, pgid);
     }
-    return bg;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/*
+ * start_job - Start the parsed pipeline cmds as a new job in the given
+ *    state and return its process group ID, or 0 if no stage could be
+ *    started. If outfd isn't -1, it receives the job's stdout and stderr
+ *    and is closed when the job is deleted. Must be called with SIGCHLD
+ *    blocked, child_mask being the mask to give to the processes.
  */
-int builtin_cmd(char **argv) 
+pid_t start_job(struct cmd_t *cmds, int ncmds, int state, char *cmdline, int outfd, const sigset_t *child_mask)
 {
-    char* command = argv[0];
-
-    if (!strcmp("quit", command)) {
-        exit(0);
-    } else if (!strcmp("jobs", command)) {
-        listjobs(jobs);
-    } else if (!strcmp("bg", command) || !strcmp("fg", command)) {
-        do_bgfg(argv);
-    } else {
-        return 0;     /* not a builtin command */
-    }
-
-    return 1;
-}
-
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
- */
+    int i, npids;
+    pid_t pid, pgid;
+    int pipefd[2];
+    int in_fd;
+    int cgfd = -1, cgid = 0, procs_fd = -1;
+    pid_t pids[MAXSTAGES];
+    struct job_t *job;
 
-int my_atoi(char* start) {
-    if (start == NULL) {
-        errno = EINVAL;
-        return 0;
+    fflush(stdout); /* the shell's output comes before the job's */
+    if (prof_job) {
+        clock_gettime(CLOCK_MONOTONIC, &prof_job->start);
     }
 
-    int result = 0;
-    char curr;
-
-    while ((curr = *start) != '\0') {
-        if ('0' <= curr && curr <= '9') {
-            result = result*10 + curr - '0';
-            ++start;
-        } else {
-            errno = EINVAL;
+    /* with -c, the stages move themselves into the job's cgroup */
+    if (cgroup_root >= 0) {
+        if ((cgfd = cgroup_create(&cgid)) < 0) {
             return 0;
         }
+        if ((procs_fd = openat(cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC)) < 0) {
+            unix_error("cgroup.procs open error");
+        }
     }
 
-    return result;
-}
+    /* start every stage in the process group of the first one, each reading
+     * the pipe written by the previous stage. All descriptors are
+     * close-on-exec, so the children only keep the ones dup'ed to 0, 1, 2.
+     * A stage that fails to start is skipped like in other shells: its
+     * neighbours just see EOF or EPIPE.
+     */
+    pgid = 0;
+    npids = 0;
+    in_fd = STDIN_FILENO;
+    if (outfd >= 0 && (in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        unix_error("Open error"); /* captured jobs must not eat the shell's input */
+    }
+    for (i = 0; i < ncmds; i++) {
+        cmds[i].in_fd = in_fd;
+        cmds[i].out_fd = STDOUT_FILENO;
+        cmds[i].err_fd = (outfd >= 0) ? outfd : STDERR_FILENO;
+        cmds[i].cg_fd = procs_fd;
+        if (i == ncmds - 1 && outfd >= 0 && !cmds[i].outfile) {
+            cmds[i].out_fd = outfd;
+        } else if (i == ncmds - 1 && prof_job && !cmds[i].outfile) {
+            cmds[i].out_fd = prof_job->out_w;
+        }
+        if (i < ncmds - 1) {
+            if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                unix_error("Pipe error");
+            }
+            cmds[i].out_fd = pipefd[1];
+            in_fd = pipefd[0];
+        }
 
-void do_bgfg(char **argv) 
-{
-    struct job_t *job;
-    int is_bg = !strcmp("bg", argv[0]);
-    int is_pid;
+        if (open_redirects(&cmds[i]) == 0 && (pid = launch_cmd(&cmds[i], pgid, child_mask)) > 0) {
+            if (!pgid) {
+                pgid = pid;
+            }
+            pids[npids++] = pid;
+        }
 
-    if (argv[1] == NULL) {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
-        return;
+        if (cmds[i].in_fd != STDIN_FILENO) {
+            close(cmds[i].in_fd);
+        }
+        if (cmds[i].out_fd != STDOUT_FILENO && cmds[i].out_fd != outfd
+            && !(prof_job && cmds[i].out_fd == prof_job->out_w)) {
+            close(cmds[i].out_fd);
+        }
     }
 
-    if (argv[1][0] == '%') { /* if it's jid */
-        is_pid = 1;
-        job = getjobjid(jobs, my_atoi(&argv[1][1]));
-    } else { /* if it's pid */
-        is_pid = 0;
-        job = getjobpid(jobs, my_atoi(argv[1]));
+    if (prof_job) {
+        profile_started(prof_job, pids, npids);
     }
 
-    if (errno == EINVAL) { //my_atoi error (wrong argument)
-        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-        return;
+    if (procs_fd >= 0) {
+        close(procs_fd);
     }
 
-    if (job == NULL) { //can't find job
-        if (is_pid) {
-            printf("%s: No such job\n", argv[1]);
-        } else {
-            printf("(%s): No such process\n", argv[1]);
+    if (npids == 0) {
+        if (cgfd >= 0) {
+            close(cgfd);
+            cgroup_remove(cgid);
         }
-    } else {
-        wrap_kill(-job->pid, SIGCONT); /* send SIGCONT signal to every process under process group */
+        return 0;
+    }
 
-        if (is_bg) { // command: bg
-            job->state = BG;
-            printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-        } else { // command: fg
-            job->state = FG;
-            waitfg(job->pid);
+    addjob(&jobs, pgid, state, cmdline);
+    if ((job = getjobpid(&jobs, pgid))) {
+        for (i = 1; i < npids; i++) {
+            addstage(&jobs, job, pids[i]);
         }
+        job->outfd = outfd;
+        job->cgfd = cgfd;
+        job->cgid = cgid;
     }
 
-    return;
+    return pgid;
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
- */
-void waitfg(pid_t pid)
+/* start_cmd - Start path with fork_cmd or spawn_cmd, whichever applies */
+static pid_t start_cmd(const char *path, struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask)
 {
-    /* according to the Hint on assignment handout, use budy loop around sleep function
-     * and do all reaping in the signal handler
-     */
-
-    while(1) {
-        if (fgpid(jobs) != pid) { /* when given foreground job terminated */
-            break;
-        } else {
-            wrap_sleep(1);
-        }
+    if (use_fork || cmd->cg_fd >= 0) {
+        /* joining a cgroup before exec needs a child of our own */
+        return fork_cmd(path, cmd, pgid, child_mask);
     }
-
-    return;
+    return spawn_cmd(path, cmd, pgid, child_mask);
 }
 
-/*****************
- * Signal handlers
- *****************/
-
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * launch_cmd - Start one pipeline stage in process group pgid (a new
+ *    group if pgid is 0). Returns its pid, or -1 after reporting that the
+ *    command could not be found.
  */
-void sigchld_handler(int sig) 
+pid_t launch_cmd(struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask)
 {
+    char *path;
     pid_t pid;
-    int status;
-    char log_message_buff[1024];
-    struct job_t *job;
-    int prev_errno = errno;
 
-    /* WNOHANG: return immediately if none of the child processes in the wait set has terminated yet.
-       WUNTRACED: return pid of the terminated or "stopped" child */
-    while((pid = wrap_waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        job = getjobpid(jobs, pid);
-
-        if (WIFSIGNALED(status)) {
-            /* when the process terminated */
-            snprintf(log_message_buff, 1024, "Job [%d] (%d) terminated by signal %d\n", job->jid, (int)pid, WTERMSIG(status));
-            sio_puts(log_message_buff);
-            deletejob(jobs, pid);
-        } else if (WIFSTOPPED(status)) {
-            /* when the process stopped */
-            snprintf(log_message_buff, 1024, "Job [%d] (%d) stopped by signal %d\n", job->jid, (int)pid, WSTOPSIG(status));
-            sio_puts(log_message_buff);
-            job->state = ST;
-        } else if (WIFEXITED(status)) {
-            /* delete finished job from the job list
-               without this, you get to send signal to wrong pid at sigint/sigtstp handler. */
-            deletejob(jobs, pid);
+    if (!(path = find_cmd(cmd->argv[0]))) {
+        pid = -1;
+    } else if ((pid = start_cmd(path, cmd, pgid, child_mask)) < 0 && hash_remove(cmd->argv[0])) {
+        /* stale hash entry (binary moved or removed): look it up again */
+        if ((path = find_cmd(cmd->argv[0]))) {
+            pid = start_cmd(path, cmd, pgid, child_mask);
         }
     }
-    
-    errno = prev_errno;
 
-    return;
+    if (pid < 0) {
+        printf("%s: Command not found\n", cmd->argv[0]);
+        fflush(stdout); /* before the other stages start writing */
+    }
+    return pid;
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+/*
+ * spawn_cmd - Start the program at path in process group pgid (a new one
+ *    if pgid is 0) with cmd's descriptors as stdin/stdout and child_mask
+ *    as its signal mask, and return its pid (-1 if the program could not
+ *    be started). glibc implements posix_spawn with
+ *    clone(CLONE_VM|CLONE_VFORK), so unlike fork the shell's page tables
+ *    are never copied, and exec failures are reported back to the caller.
  */
-void sigint_handler(int sig) 
+pid_t spawn_cmd(const char *path, struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask)
 {
-    /* preserve previous errno */
-    int prev_errno = errno;
+    pid_t pid;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t def_mask;
+    int rc;
 
-    pid_t foreground_pid = fgpid(jobs);
+    /* handlers are reset by exec anyway; SETSIGDEF also resets ignored ones */
+    wrap_sigemptyset(&def_mask);
+    wrap_sigaddset(&def_mask, SIGINT);
+    wrap_sigaddset(&def_mask, SIGTSTP);
+    wrap_sigaddset(&def_mask, SIGCHLD);
+    wrap_sigaddset(&def_mask, SIGQUIT);
 
-    if (foreground_pid != 0) {
-        /* if there is a foreground job, send SIGINT */
-        wrap_kill(-foreground_pid, sig);
+    if ((rc = posix_spawnattr_init(&attr)) != 0) {
+        errno = rc;
+        unix_error("posix_spawnattr_init error");
+    }
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid); /* same as setpgid(0, pgid) in the child */
+    posix_spawnattr_setsigmask(&attr, child_mask);
+    posix_spawnattr_setsigdefault(&attr, &def_mask);
+
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = rc;
+        unix_error("posix_spawn_file_actions_init error");
+    }
+    if (cmd->in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, cmd->in_fd, STDIN_FILENO);
+    }
+    if (cmd->out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, cmd->out_fd, STDOUT_FILENO);
+    }
+    if (cmd->err_fd != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, cmd->err_fd, STDERR_FILENO);
     }
 
-    errno = prev_errno;
-    return;
+    rc = posix_spawn(&pid, path, &actions, &attr, cmd->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * fork_cmd - Same as spawn_cmd but with the classic fork+execve. The
+ *    child reports an exec failure as its errno over a close-on-exec pipe,
+ *    so the parent reaps it and returns -1 just like spawn_cmd does.
  */
-void sigtstp_handler(int sig) 
+pid_t fork_cmd(const char *path, struct cmd_t *cmd, pid_t pgid, const sigset_t *child_mask)
 {
-    int prev_errno = errno;
-
-    pid_t foreground_pid = fgpid(jobs);
+    pid_t pid;
+    int errfd[2];
+    int err;
+    ssize_t n;
 
-    if (foreground_pid != 0) {
-        /* if there is a foreground job, send SIGTSTP */
-        wrap_kill(-foreground_pid, sig);
+    if (pipe2(errfd, O_CLOEXEC) < 0) {
+        unix_error("Pipe error");
     }
 
-    errno = prev_errno;
-
-    return;
+    if ((pid = wrap_fork()) == 0) {
+        // Child's behavior
+        close(errfd[0]);
+        setpgid(0, pgid);
+        if (cmd->cg_fd >= 0 && write(cmd->cg_fd, "0", 1) < 0) {
+            printf("%s: cgroup.procs: %s\n", cmd->argv[0], strerror(errno));
+            exit(1);
+        }
+        wrap_sigprocmask(SIG_SETMASK, child_mask, NULL);
+        if (cmd->in_fd != STDIN_FILENO) {
+            dup2(cmd->in_fd, STDIN_FILENO);
+        }
+        if (cmd->out_fd != STDOUT_FILENO) {
+            dup2(cmd->out_fd, STDOUT_FILENO);
+        }
+        if (cmd->err_fd != STDERR_FILENO) {
+            dup2(cmd->err_fd, STDERR_FILENO);
+        }
+        
+        execve(path, cmd->argv, environ);
+        err = errno;
+        write(errfd[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    setpgid(pid, pgid ? pgid : pid); /* don't race the child for it */
+
+    /* EOF means the exec went through; SIGCHLD is blocked, so the child
+       can't be reaped behind our back before we wait for it */
+    close(errfd[1]);
+    while ((n = read(errfd[0], &err, sizeof(err))) < 0 && errno == EINTR) {
+        ;
+    }
+    close(errfd[0]);
+    if (n == sizeof(err)) {
+        waitpid(pid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * The command line parser. tokenize() makes a single pass over the line,
+ * dropping quotes and escapes and expanding variables as it goes, and
+ * parse_cmdline() groups the tokens into stages and pipelines. The words,
+ * argv arrays, stages and pipelines live in the arrays of a parse_t that
+ * is reused from line to line and only grows for a longer line, so there
+ * is no allocation per token and no limit on line length or arguments.
+ */
+
+/* parse_grow - Make room for n elements of size sz in the array *arr */
+static void parse_grow(void *arr, int *cap, int n, size_t sz)
+{
+    void **ptr = arr;
+
+    if (n <= *cap) {
+        return;
+    }
+    while (*cap < n) {
+        *cap = *cap ? *cap * 2 : 64;
+    }
+    if (!(*ptr = realloc(*ptr, *cap * sz))) {
+        unix_error("realloc error");
+    }
+}
+
+/* parse_putc - Append a character to the word being built */
+static void parse_putc(struct parse_t *p, char c)
+{
+    if (p->len == p->bufcap) {
+        parse_grow(&p->buf, &p->bufcap, p->len + 1, 1);
+    }
+    p->buf[p->len++] = c;
+}
+
+/* parse_putn - Append n characters to the word being built */
+static void parse_putn(struct parse_t *p, const char *s, int n)
+{
+    parse_grow(&p->buf, &p->bufcap, p->len + n, 1);
+    memcpy(p->buf + p->len, s, n);
+    p->len += n;
+}
+
+/*
+ * expand_var - Append the value of the variable named just past a '$'
+ *    and return how many characters the name took. Knows $NAME, ${NAME},
+ *    $? and $$; a '$' followed by anything else is kept as it is.
+ */
+static int expand_var(struct parse_t *p, const char *s)
+{
+    char num[16];
+    char *value;
+    int braced = (*s == '{');
+    int n = braced;
+    int mark;
+
+    if (*s == '?' || *s == '$') {
+        snprintf(num, sizeof(num), "%d", *s == '?' ? (int)last_status : (int)getpid());
+        parse_putn(p, num, strlen(num));
+        return 1;
+    }
+    if (!isalpha((unsigned char)s[n]) && s[n] != '_') {
+        parse_putc(p, '$');
+        return 0;
+    }
+    while (isalnum((unsigned char)s[n]) || s[n] == '_') {
+        n++;
+    }
+    if (braced && s[n] != '}') {
+        parse_putc(p, '$');
+        return 0;
+    }
+
+    /* terminate the name at the end of the buffer to look it up */
+    mark = p->len;
+    parse_putn(p, s + braced, n - braced);
+    parse_putc(p, '\0');
+    value = getenv(p->buf + mark);
+    p->len = mark;
+    if (value) {
+        parse_putn(p, value, strlen(value));
+    }
+    return n + braced;
+}
+
+/* is_blank - Does c separate words? */
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* is_op - Does c start an operator? */
+static int is_op(char c)
+{
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+/*
+ * tokenize - Split the command line into words and operators from *pos up
+ *    to the end of the pipeline there, and move *pos past it. Single
+ *    quotes keep everything literal, double quotes keep all but $
+ *    expansion and \", \\ and \$, a backslash outside quotes escapes any
+ *    character, and # starts a comment. Expanded values are not split
+ *    into words. Return -1 after reporting an unterminated quote.
+ */
+static int tokenize(struct parse_t *p, const char *line, int *pos)
+{
+    const char *s = line + *pos;
+    const char *close;
+    struct token_t *tok;
+    int quoted;
+
+    p->len = p->ntoks = 0;
+    while (1) {
+        while (is_blank(*s)) {
+            s++;
+        }
+        if (*s == '\0' || *s == '#') {
+            *pos = s - line + (*s == '#' ? strlen(s) : 0);
+            return 0;
+        }
+
+        parse_grow(&p->toks, &p->tokcap, p->ntoks + 1, sizeof(struct token_t));
+        tok = &p->toks[p->ntoks++];
+        tok->start = s - line;
+
+        if (is_op(*s)) {
+            switch (*s) {
+            case '|': tok->type = (s[1] == '|') ? T_OR : T_PIPE; break;
+            case '&': tok->type = (s[1] == '&') ? T_AND : T_AMP; break;
+            case ';': tok->type = T_SEMI; break;
+            case '<': tok->type = T_IN; break;
+            default:  tok->type = (s[1] == '>') ? T_APPEND : T_OUT; break;
+            }
+            s += (tok->type == T_OR || tok->type == T_AND || tok->type == T_APPEND) ? 2 : 1;
+            tok->end = s - line;
+            if (tok->type != T_PIPE && tok->type < T_IN) {
+                *pos = tok->end;
+                return 0;
+            }
+            continue;
+        }
+
+        tok->type = T_WORD;
+        tok->word = p->len;
+        quoted = 0;
+        while (*s && !is_blank(*s) && !is_op(*s)) {
+            if (*s == '\\') {
+                if (*++s) {
+                    if (*s != '\n') {
+                        parse_putc(p, *s);
+                    }
+                    s++;
+                }
+            } else if (*s == '\'') {
+                if (!(close = strchr(s + 1, '\''))) {
+                    printf("syntax error: unterminated quote\n");
+                    return -1;
+                }
+                parse_putn(p, s + 1, close - s - 1);
+                s = close + 1;
+                quoted = 1;
+            } else if (*s == '"') {
+                for (s++; *s != '"'; ) {
+                    if (!*s) {
+                        printf("syntax error: unterminated quote\n");
+                        return -1;
+                    }
+                    if (s[0] == '\\' && (s[1] == '"' || s[1] == '\\' || s[1] == '$')) {
+                        parse_putc(p, s[1]);
+                        s += 2;
+                    } else if (*s == '$') {
+                        s += 1 + expand_var(p, s + 1);
+                    } else {
+                        parse_putc(p, *s++);
+                    }
+                }
+                s++;
+                quoted = 1;
+            } else if (*s == '$') {
+                s += 1 + expand_var(p, s + 1);
+            } else {
+                parse_putc(p, *s++);
+            }
+        }
+        tok->end = s - line;
+
+        if (p->len == tok->word && !quoted) {
+            p->ntoks--;         /* an unquoted variable that expanded to nothing */
+        } else {
+            parse_putc(p, '\0');
+        }
+    }
+}
+
+/* syntax_error - Report an operator in the wrong place */
+static int syntax_error(const char *cmdline, struct token_t *tok)
+{
+    printf("syntax error near '%.*s'\n", tok->end - tok->start, cmdline + tok->start);
+    return -1;
+}
+
+/*
+ * parse_pipeline - Parse the pipeline starting at *pos in the command line
+ *    into p->pl, and move *pos past the ;, &, && or || ending it. Stages
+ *    are separated by | and hold words and < > >> redirections. Pipelines
+ *    are parsed one at a time, when they are about to run, so that $?
+ *    expands to the status of the one before. Return 1 if there was a
+ *    pipeline, 0 at the end of the line, or -1 after reporting a syntax
+ *    error.
+ */
+int parse_pipeline(struct parse_t *p, const char *cmdline, int *pos)
+{
+    struct token_t *tok;
+    struct pipeline_t *pl = &p->pl;
+    struct cmd_t *cmd = NULL;     /* the stage being built */
+    int nargs = 0;
+    int argc = 0;                 /* words in the current stage */
+    int i;
+
+    if (*pos == 0) {
+        p->cond = T_SEMI;
+    }
+    if (tokenize(p, cmdline, pos) < 0) {
+        return -1;
+    }
+
+    /* every stage holds a word and a NULL, so these are enough */
+    parse_grow(&p->argv, &p->argcap, 2 * p->ntoks + 1, sizeof(char *));
+    parse_grow(&p->cmds, &p->cmdcap, p->ntoks + 1, sizeof(struct cmd_t));
+    pl->cmds = p->cmds;
+    pl->ncmds = 0;
+    pl->bg = 0;
+    pl->cond = p->cond;
+
+    for (i = 0; i < p->ntoks; i++) {
+        tok = &p->toks[i];
+
+        if (tok->type == T_WORD || tok->type >= T_IN) {
+            if (pl->ncmds == 0) {
+                pl->start = tok->start;
+            }
+            if (!cmd) {
+                cmd = &p->cmds[pl->ncmds++];
+                cmd->argv = &p->argv[nargs];
+                cmd->infile = cmd->outfile = NULL;
+                cmd->append = 0;
+                argc = 0;
+            }
+            if (tok->type == T_WORD) {
+                p->argv[nargs++] = p->buf + tok->word;
+                argc++;
+            } else {
+                if (i + 1 == p->ntoks || tok[1].type != T_WORD) {
+                    return syntax_error(cmdline, tok);
+                }
+                if (tok->type == T_IN) {
+                    cmd->infile = p->buf + tok[1].word;
+                } else {
+                    cmd->outfile = p->buf + tok[1].word;
+                    cmd->append = (tok->type == T_APPEND);
+                }
+                i++;
+            }
+            pl->end = p->toks[i].end;
+            continue;
+        }
+
+        /* any operator ends the stage, all but | the pipeline too */
+        if (argc == 0) {
+            return syntax_error(cmdline, tok);
+        }
+        p->argv[nargs++] = NULL;
+        cmd = NULL;
+        argc = 0;
+        if (tok->type == T_PIPE) {
+            if (pl->ncmds == MAXSTAGES) {
+                return syntax_error(cmdline, tok);
+            }
+            continue;
+        }
+        if (tok->type == T_AMP) {
+            pl->bg = 1;
+            pl->end = tok->end;
+        }
+        p->cond = (tok->type == T_AMP) ? T_SEMI : tok->type;
+        return 1;
+    }
+
+    if (argc > 0) {
+        p->argv[nargs++] = NULL;
+        p->cond = T_SEMI;
+        return 1;
+    }
+    if (pl->ncmds > 0 || p->cond != T_SEMI) {
+        printf("syntax error: missing command\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * pipeline_text - Copy the part of the command line making up pl into buf
+ *    (MAXLINE bytes), newline terminated, to show in the job list
+ */
+void pipeline_text(char *buf, const char *cmdline, struct pipeline_t *pl)
+{
+    int len = pl->end - pl->start;
+
+    if (len > MAXLINE - 2) {
+        len = MAXLINE - 2;
+    }
+    snprintf(buf, MAXLINE, "%.*s\n", len, cmdline + pl->start);
+}
+
+/*
+ * open_redirects - Open cmd's redirection files (close-on-exec) in place
+ *    of its pipe descriptors. Return -1 after reporting a failed open.
+ */
+int open_redirects(struct cmd_t *cmd)
+{
+    int fd;
+    int flags;
+
+    if (cmd->infile) {
+        if ((fd = open(cmd->infile, O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("%s: %s\n", cmd->infile, strerror(errno));
+            fflush(stdout);
+            return -1;
+        }
+        if (cmd->in_fd != STDIN_FILENO) {
+            close(cmd->in_fd);
+        }
+        cmd->in_fd = fd;
+    }
+
+    if (cmd->outfile) {
+        flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC);
+        if ((fd = open(cmd->outfile, flags, 0666)) < 0) {
+            printf("%s: %s\n", cmd->outfile, strerror(errno));
+            fflush(stdout);
+            return -1;
+        }
+        if (cmd->out_fd != STDOUT_FILENO) {
+            close(cmd->out_fd);
+        }
+        cmd->out_fd = fd;
+    }
+
+    return 0;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately, in the shell, and set last_status. Its > and >>
+ *    redirections go to the shell's stdout while it runs; < is only
+ *    checked, as no builtin reads its input (and the shell's own input
+ *    must stay where it is). Return 0 if it isn't a builtin.
+ */
+int builtin_cmd(struct cmd_t *cmd) 
+{
+    struct builtin_t *builtin;
+    int saved_out = -1;
+
+    if (!(builtin = find_builtin(cmd->argv[0]))) {
+        return 0;     /* not a builtin command */
+    }
+
+    if (cmd->infile || cmd->outfile) {
+        cmd->in_fd = STDIN_FILENO;
+        cmd->out_fd = STDOUT_FILENO;
+        if (open_redirects(cmd) < 0) {
+            last_status = 1;
+            return 1;
+        }
+        if (cmd->in_fd != STDIN_FILENO) {
+            close(cmd->in_fd);
+        }
+        if (cmd->out_fd != STDOUT_FILENO) {
+            fflush(stdout);
+            if ((saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) < 0) {
+                unix_error("fcntl error");
+            }
+            dup2(cmd->out_fd, STDOUT_FILENO);
+            close(cmd->out_fd);
+        }
+    }
+
+    last_status = builtin->fn(cmd->argv);
+
+    if (saved_out >= 0) {
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return 1;
+}
+
+/*
+ * time_builtin - builtin_cmd for "time <builtin>": run it and report the
+ *    shell's own resource usage for it
+ */
+int time_builtin(struct cmd_t *cmd)
+{
+    struct timespec start, end;
+    struct rusage before, after;
+    struct timeval utime, stime;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+    if ((rc = builtin_cmd(cmd))) {
+        getrusage(RUSAGE_SELF, &after);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        timersub(&after.ru_utime, &before.ru_utime, &utime);
+        timersub(&after.ru_stime, &before.ru_stime, &stime);
+        fflush(stdout);
+        print_usage("", (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+                    &utime, &stime, after.ru_maxrss);
+    }
+    return rc;
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+
+int my_atoi(char* start) {
+    if (start == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    int result = 0;
+    char curr;
+
+    while ((curr = *start) != '\0') {
+        if ('0' <= curr && curr <= '9') {
+            result = result*10 + curr - '0';
+            ++start;
+        } else {
+            errno = EINVAL;
+            return 0;
+        }
+    }
+
+    return result;
+}
+
+void do_bgfg(char **argv) 
+{
+    struct job_t *job;
+    sigset_t prev_mask;
+    pid_t pid;
+    int is_bg = !strcmp("bg", argv[0]);
+    int is_pid;
+
+    if (argv[1] == NULL) {
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        return;
+    }
+
+    if (argv[1][0] == '%') { /* if it's jid */
+        is_pid = 1;
+        job = getjobjid(&jobs, my_atoi(&argv[1][1]));
+    } else { /* if it's pid */
+        is_pid = 0;
+        job = getjobpid(&jobs, my_atoi(argv[1]));
+    }
+
+    if (errno == EINVAL) { //my_atoi error (wrong argument)
+        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        return;
+    }
+
+    if (job == NULL) { //can't find job
+        if (is_pid) {
+            printf("%s: No such job\n", argv[1]);
+        } else {
+            printf("(%s): No such process\n", argv[1]);
+        }
+    } else {
+        /* the handler may stop or delete the job meanwhile */
+        block_sigchld(&prev_mask);
+
+        wrap_kill(-job->pid, SIGCONT); /* send SIGCONT signal to every process under process group */
+
+        if (is_bg) { // command: bg
+            setjobstate(&jobs, job, BG);
+            printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        } else { // command: fg
+            setjobstate(&jobs, job, FG);
+        }
+        pid = job->pid;
+        unblock_sigchld(&prev_mask);
+
+        if (!is_bg) {
+            waitfg(pid);
+        }
+    }
+
+    return;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid)
+{
+    sigset_t prev_mask;
+
+    /* SIGCHLD stays blocked while the job list is inspected, and
+     * sleep_sigchld atomically unblocks it and sleeps, so a child that
+     * exits between the check and the sleep can't be missed.
+     */
+    block_sigchld(&prev_mask);
+
+    while (fgpid(&jobs) == pid) { /* until given foreground job terminated or stopped */
+        sleep_sigchld(&prev_mask);
+    }
+
+    unblock_sigchld(&prev_mask);
+
+    return;
+}
+
+/*
+ * do_wait - Execute the builtin wait command: block until no job is
+ *    running any more (stopped jobs don't count)
+ */
+void do_wait(void)
+{
+    sigset_t prev_mask;
+
+    block_sigchld(&prev_mask);
+
+    while (jobs.nrunning > 0) {
+        sleep_sigchld(&prev_mask);
+        dump_finished();
+    }
+    dump_finished();
+
+    unblock_sigchld(&prev_mask);
+}
+
+/*
+ * run_batch - Run the commands read from stdin as background jobs, at most
+ *    batch_slots at a time. Each job's stdout and stderr go to a memory
+ *    file that is printed in one piece when the job completes, so outputs
+ *    come out whole, in completion order. A 'wait' line is a barrier: the
+ *    commands after it start once everything before it has finished.
+ *    Builtins run in the shell as they are read. Exits with status 1 if
+ *    any job failed.
+ */
+void run_batch(void)
+{
+    static struct parse_t parse;
+    struct pipeline_t *pl = &parse.pl;
+    char *cmdline;
+    char text[MAXLINE];
+    sigset_t prev_mask;
+    int pos, rc, outfd;
+
+    /* a job's output waits there until the shell is out of the handler;
+       never more of them than jobs running at once */
+    if (!(batch_done = malloc(batch_slots * sizeof(int)))) {
+        unix_error("malloc error");
+    }
+
+    while ((cmdline = read_cmdline()) != NULL) {
+        /* each pipeline is a job of its own, a trailing & changes nothing */
+        pos = 0;
+        while ((rc = parse_pipeline(&parse, cmdline, &pos)) > 0) {
+            if (pl->cond != T_SEMI) {
+                printf("&& and || can't be used in batch mode\n");
+                batch_failed = 1;
+                break;
+            }
+            if (pl->ncmds == 1 && builtin_cmd(&pl->cmds[0])) {
+                fflush(stdout);
+                continue;
+            }
+
+            if ((outfd = memfd_create("tsh-job", MFD_CLOEXEC)) < 0) {
+                unix_error("memfd_create error");
+            }
+
+            pipeline_text(text, cmdline, pl);
+            block_sigchld(&prev_mask);
+            dump_finished();
+            while (jobs.nrunning >= batch_slots) {
+                sleep_sigchld(&prev_mask);
+                dump_finished();
+            }
+            if (!start_job(pl->cmds, pl->ncmds, BG, text, outfd, &prev_mask)) {
+                close(outfd);
+                batch_failed = 1;
+            }
+            unblock_sigchld(&prev_mask);
+        }
+        if (rc < 0) {
+            batch_failed = 1;
+        }
+    }
+
+    do_wait();
+    fflush(stdout);
+    exit(batch_failed);
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+void sigchld_handler(int sig) 
+{
+    int prev_errno = errno;
+
+    reap_children();
+    
+    errno = prev_errno;
+
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void sigint_handler(int sig) 
+{
+    /* preserve previous errno */
+    int prev_errno = errno;
+
+    pid_t foreground_pid = fgpid(&jobs);
+    struct job_t *job = jobs.fgjob;
+
+    if (foreground_pid != 0 && job && job->pid == foreground_pid && job->cgfd >= 0) {
+        /* kill everything in the job's cgroup, even what left the group */
+        cgroup_kill(job);
+    } else if (foreground_pid != 0) {
+        /* if there is a foreground job, send SIGINT */
+        wrap_kill(-foreground_pid, sig);
+    }
+
+    errno = prev_errno;
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void sigtstp_handler(int sig) 
+{
+    int prev_errno = errno;
+
+    pid_t foreground_pid = fgpid(&jobs);
+
+    if (foreground_pid != 0) {
+        /* if there is a foreground job, send SIGTSTP */
+        wrap_kill(-foreground_pid, sig);
+    }
+
+    errno = prev_errno;
+
+    return;
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/*
+ * reap_children - Reap all available zombie children and record stopped
+ *     ones in the job list. Called from sigchld_handler, or in event mode
+ *     from the main flow whenever the signalfd reports SIGCHLD, so it
+ *     sticks to async-signal-safe calls.
+ */
+void reap_children(void)
+{
+    pid_t pid;
+    int status;
+    char log_message_buff[1024];
+    struct job_t *job;
+    struct rusage ru;
+
+    /* WNOHANG: return immediately if none of the child processes in the wait set has terminated yet.
+       WUNTRACED: return pid of the terminated or "stopped" child */
+    while((pid = wrap_wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        if (!(job = getjobpid(&jobs, pid))) {
+            continue;
+        }
+
+        if (WIFSTOPPED(status)) {
+            /* when the process stopped: the whole process group got the
+               signal, report the job once */
+            if (job->state != ST) {
+                if (job->state == FG) {
+                    last_status = 128 + WSTOPSIG(status);
+                }
+                snprintf(log_message_buff, 1024, "Job [%d] (%d) stopped by signal %d\n", job->jid, (int)job->pid, WSTOPSIG(status));
+                sio_puts(log_message_buff);
+                setjobstate(&jobs, job, ST);
+            }
+        } else if (WIFSIGNALED(status) || WIFEXITED(status)) {
+            /* when the process terminated: the job is finished once its
+               last stage is gone. SIGPIPE is how pipeline writers normally
+               end, so it is not reported */
+            if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE && !job->termsig) {
+                job->termsig = WTERMSIG(status);
+            }
+            if (WIFEXITED(status) && pid == job->pids[job->nstages - 1]) {
+                job->exitstatus = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status) && pid == job->pids[job->nstages - 1]) {
+                job->lastsig = WTERMSIG(status);
+            }
+            timeradd(&job->utime, &ru.ru_utime, &job->utime);
+            timeradd(&job->stime, &ru.ru_stime, &job->stime);
+            if (ru.ru_maxrss > job->maxrss) {
+                job->maxrss = ru.ru_maxrss;
+            }
+            if (removestage(&jobs, job, pid) == 0) {
+                if (job->cgfd >= 0) {
+                    cgroup_usage(job);
+                }
+                if (job->outfd >= 0) {
+                    /* printed by dump_finished, outside the handler */
+                    batch_done[batch_tail++ % batch_slots] = job->outfd;
+                    if (job->exitstatus || job->termsig) {
+                        batch_failed = 1;
+                    }
+                }
+                if (job->termsig) {
+                    snprintf(log_message_buff, 1024, "Job [%d] (%d) terminated by signal %d\n", job->jid, (int)job->pid, job->termsig);
+                }
+                if (tag_output && job->state != FG) {
+                    /* -o: reported at the next prompt, after its output */
+                    if (job->exitstatus && !job->termsig) {
+                        snprintf(log_message_buff, 1024, "[%d] (%d) Exit %d %.900s", job->jid, (int)job->pid, job->exitstatus, job->cmdline);
+                    } else if (!job->termsig) {
+                        snprintf(log_message_buff, 1024, "[%d] (%d) Done %.900s", job->jid, (int)job->pid, job->cmdline);
+                    }
+                    if (notice_tail - notice_head == MAXNOTICES) {
+                        /* ring full: print what it holds now rather than drop one */
+                        while (notice_head != notice_tail) {
+                            sio_puts(notices[notice_head++ % MAXNOTICES].msg);
+                        }
+                    }
+                    strcpy(notices[notice_tail++ % MAXNOTICES].msg, log_message_buff);
+                } else if (job->termsig) {
+                    sio_puts(log_message_buff);
+                }
+                if (job->timed || account_all) {
+                    report_job_usage(job);
+                }
+                if (job->state == FG) {
+                    last_status = job->termsig ? 128 + job->termsig : job->exitstatus;
+                    last_killed = job->termsig || job->lastsig;
+                }
+                if (job->cgfd >= 0) {
+                    /* whatever the job left behind (daemons) goes too */
+                    cgroup_kill(job);
+                    close(job->cgfd);
+                    cgroup_remove(job->cgid);
+                }
+                /* delete finished job from the job list
+                   without this, you get to send signal to wrong pid at sigint/sigtstp handler. */
+                deletejob(&jobs, job->pid);
+            }
+        }
+    }
+}
+
+/*
+ * dump_output - Copy a finished job's captured output to stdout and
+ *     close it. A write error is reported and fails the batch, but
+ *     doesn't end the shell.
+ */
+void dump_output(int fd)
+{
+    char buf[MAXLINE];
+    ssize_t n, off, rc;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; off += rc) {
+            if ((rc = write(STDOUT_FILENO, buf + off, n - off)) < 0) {
+                if (errno == EINTR) {
+                    rc = 0;
+                    continue;
+                }
+                fprintf(stderr, "tsh: job output: %s\n", strerror(errno));
+                batch_failed = 1;
+                close(fd);
+                return;
+            }
+        }
+    }
+    close(fd);
+}
+
+/*
+ * dump_finished - Print the outputs of the batch jobs the SIGCHLD handler
+ *     found finished, in completion order. Called with SIGCHLD blocked.
+ */
+void dump_finished(void)
+{
+    while (batch_head != batch_tail) {
+        dump_output(batch_done[batch_head++ % batch_slots]);
+    }
+}
+
+/*
+ * print_usage - Print one line of resource usage (async-signal-safe:
+ *     integer formatting only)
+ */
+void print_usage(char *prefix, long real_ms, struct timeval *utime, struct timeval *stime, long maxrss)
+{
+    char buf[MAXLINE];
+
+    snprintf(buf, MAXLINE, "%sreal %ld.%03lds user %ld.%03lds sys %ld.%03lds maxrss %ldKB\n",
+             prefix, real_ms / 1000, real_ms % 1000,
+             (long)utime->tv_sec, (long)utime->tv_usec / 1000,
+             (long)stime->tv_sec, (long)stime->tv_usec / 1000, maxrss);
+    sio_puts(buf);
+}
+
+/* job_real_ms - Milliseconds since the job was started */
+static long job_real_ms(struct job_t *job)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - job->start.tv_sec) * 1000 + (now.tv_nsec - job->start.tv_nsec) / 1000000;
+}
+
+/*
+ * report_job_usage - Print the usage of a job whose processes have all
+ *     been reaped. "time" reports its own job plainly, -a tags the job.
+ */
+void report_job_usage(struct job_t *job)
+{
+    char prefix[64];
+
+    prefix[0] = '\0';
+    if (!job->timed) {
+        snprintf(prefix, sizeof(prefix), "Job [%d] (%d) ", job->jid, (int)job->pid);
+    }
+    print_usage(prefix, job_real_ms(job), &job->utime, &job->stime, job->maxrss);
+}
+
+/*
+ * block_sigchld - Keep SIGCHLD processing away from the job list, saving
+ *     the mask to restore (and to give to new jobs) in prev_mask. In event
+ *     mode SIGCHLD is blocked for good and this costs no system call.
+ */
+void block_sigchld(sigset_t *prev_mask)
+{
+    sigset_t mask;
+
+    if (event_mode) {
+        *prev_mask = child_mask;
+        return;
+    }
+
+    wrap_sigemptyset(&mask);
+    wrap_sigaddset(&mask, SIGCHLD);
+    wrap_sigprocmask(SIG_BLOCK, &mask, prev_mask);
+}
+
+/* unblock_sigchld - Undo block_sigchld */
+void unblock_sigchld(const sigset_t *prev_mask)
+{
+    if (!event_mode) {
+        wrap_sigprocmask(SIG_SETMASK, prev_mask, NULL);
+    }
+}
+
+/*
+ * sleep_sigchld - Sleep until child status changes have been processed.
+ *     Called between block_sigchld and unblock_sigchld, prev_mask being
+ *     the mask block_sigchld saved.
+ */
+void sleep_sigchld(const sigset_t *prev_mask)
+{
+    struct pollfd pfd;
+
+    fflush(stdout); /* the handler writes straight to stdout */
+
+    if (tag_output) {
+        /* print BG output while waiting; epoll_pwait unblocks SIGCHLD
+           atomically like sigsuspend */
+        drain_streams(-1, event_mode ? NULL : prev_mask);
+        return;
+    }
+
+    if (!event_mode) {
+        wrap_sigsuspend(prev_mask); /* the handler runs before this returns */
+        return;
+    }
+
+    /* SIGCHLD is always blocked: sleep on the signalfd instead */
+    pfd.fd = sigchld_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        unix_error("poll error");
+    }
+    drain_sigchld_fd();
+}
+
+/*
+ * init_event_mode - Block SIGCHLD for good and have it delivered through
+ *     a signalfd, which the read/eval loop and waitfg watch alongside the
+ *     input. Jobs are started with the original signal mask.
+ */
+void init_event_mode(void)
+{
+    sigset_t mask;
+
+    wrap_sigemptyset(&mask);
+    wrap_sigaddset(&mask, SIGCHLD);
+    wrap_sigprocmask(SIG_BLOCK, &mask, &child_mask);
+
+    if ((sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        unix_error("signalfd error");
+    }
+}
+
+/*
+ * drain_sigchld_fd - Consume the pending SIGCHLD notifications and reap.
+ *     Notifications coalesce, so one reap_children pass covers them all
+ *     however many children changed state.
+ */
+void drain_sigchld_fd(void)
+{
+    struct signalfd_siginfo info[16];
+
+    while (read(sigchld_fd, info, sizeof(info)) > 0)
+        ;
+    reap_children();
+}
+
+/*
+ * wait_input - Process child events and BG job output until the next
+ *     command line can be read: right away if a whole line is buffered
+ *     already, else once stdin becomes readable, be it a terminal, a pipe
+ *     or a file. With -o the signalfd is in the epoll set, so watching
+ *     that covers both.
+ */
+void wait_input(void)
+{
+    struct pollfd pfds[2];
+
+    fflush(stdout); /* reap_children writes straight to stdout */
+    if (event_mode) {
+        drain_sigchld_fd();
+    }
+    if (inbuf.start < inbuf.end
+        && memchr(inbuf.buf + inbuf.start, '\n', inbuf.end - inbuf.start)) {
+        return;
+    }
+
+    pfds[0].fd = STDIN_FILENO;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = tag_output ? out_epfd : sigchld_fd;
+    pfds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("poll error");
+        }
+        if (pfds[1].revents && tag_output) {
+            drain_streams(0, NULL);
+        } else if (pfds[1].revents) {
+            drain_sigchld_fd();
+        }
+        if (pfds[0].revents) {
+            return;
+        }
+    }
+}
+
+/*
+ * init_tag_output - Set up -o: every BG job's stdout and stderr go to a
+ *     pipe the shell reads, through one epoll instance, and prints line by
+ *     line tagged with the job ID, so that the lines of parallel jobs
+ *     don't get mixed up. Completions are reported when the next prompt
+ *     is printed instead of from the SIGCHLD handler.
+ */
+void init_tag_output(void)
+{
+    struct epoll_event ev;
+
+    if ((out_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    if (event_mode) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; /* child events, not a stream */
+        if (epoll_ctl(out_epfd, EPOLL_CTL_ADD, sigchld_fd, &ev) < 0) {
+            unix_error("epoll_ctl error");
+        }
+    }
+}
+
+/* add_stream - Watch the read end of a BG job's output pipe */
+void add_stream(int fd, int jid)
+{
+    struct stream_t *stream;
+    struct epoll_event ev;
+
+    if (!(stream = malloc(sizeof(struct stream_t)))) {
+        unix_error("malloc error");
+    }
+    stream->fd = fd;
+    stream->jid = jid;
+    stream->len = 0;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = stream;
+    if (epoll_ctl(out_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+}
+
+/* put_line - Print a line of job jid's output, tagged */
+static void put_line(int jid, char *line, int len)
+{
+    printf("[%d] %.*s%s", jid, len, line, (len && line[len - 1] == '\n') ? "" : "\n");
+}
+
+/*
+ * read_stream - Print the complete lines the stream has for us. At EOF
+ *     the unfinished line goes out too and the stream is closed.
+ */
+static void read_stream(struct stream_t *stream)
+{
+    char *nl;
+    char *line;
+    ssize_t n;
+
+    while ((n = read(stream->fd, stream->buf + stream->len, MAXLINE - stream->len)) > 0
+           || (n < 0 && errno == EINTR)) {
+        if (n < 0) {
+            continue;         /* a SIGCHLD came in: not the end of the stream */
+        }
+        stream->len += n;
+        line = stream->buf;
+        while ((nl = memchr(line, '\n', stream->buf + stream->len - line))) {
+            put_line(stream->jid, line, nl + 1 - line);
+            line = nl + 1;
+        }
+        stream->len -= line - stream->buf;
+        memmove(stream->buf, line, stream->len);
+        if (stream->len == MAXLINE) { /* too long for a line: split it */
+            put_line(stream->jid, stream->buf, stream->len);
+            stream->len = 0;
+        }
+    }
+    if (n == 0 || errno != EAGAIN) {
+        if (stream->len > 0) {
+            put_line(stream->jid, stream->buf, stream->len);
+        }
+        epoll_ctl(out_epfd, EPOLL_CTL_DEL, stream->fd, NULL);
+        close(stream->fd);
+        free(stream);
+    }
+}
+
+/*
+ * drain_streams - Wait up to timeout ms (-1: forever) for BG job output
+ *     or, in event mode, child events, and handle whatever is ready. If
+ *     mask isn't NULL it is the signal mask to wait with, as in sigsuspend.
+ */
+void drain_streams(int timeout, const sigset_t *mask)
+{
+    struct epoll_event evs[16];
+    int i, n;
+
+    do {
+        if ((n = epoll_pwait(out_epfd, evs, 16, timeout, mask)) < 0) {
+            if (errno != EINTR) {
+                unix_error("epoll_pwait error");
+            }
+            return;           /* the SIGCHLD handler ran */
+        }
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.ptr) {
+                read_stream(evs[i].data.ptr);
+            } else {
+                drain_sigchld_fd();
+            }
+        }
+        timeout = 0;          /* only wait for the first batch */
+    } while (n == 16);
+    fflush(stdout);
+}
+
+/*
+ * report_bg - Print the BG job output available, then the completions
+ *     the SIGCHLD handler queued. A finished job's output is all in its
+ *     pipe already, so it comes before the job's notice.
+ */
+void report_bg(void)
+{
+    sigset_t prev_mask;
+
+    drain_streams(0, NULL);
+
+    block_sigchld(&prev_mask);
+    while (notice_head != notice_tail) {
+        fputs(notices[notice_head++ % MAXNOTICES].msg, stdout);
+    }
+    unblock_sigchld(&prev_mask);
+    fflush(stdout);
+}
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/*
+ * The job list is a pool of job structs that never move once allocated,
+ * indexed by a jid -> job array and an open addressing pid -> job hash
+ * table holding every live process of every job. Everything that may
+ * allocate (addjob, addstage) runs with SIGCHLD blocked; the SIGCHLD
+ * handler only looks entries up, marks hash slots deleted and puts jobs
+ * back on the free list, so it never sees a table being resized.
+ */
+
+/* pidhash - Home slot of pid in a hash table of cap (a power of 2) slots */
+static unsigned int pidhash(pid_t pid, int cap)
+{
+    return ((unsigned int)pid * 2654435761u) & (cap - 1);
+}
+
+/* pid_insert - Map pid to job, growing the table if it gets too full */
+static void pid_insert(struct jobs_t *jobs, pid_t pid, struct job_t *job)
+{
+    struct pidslot_t *old = jobs->bypid;
+    int oldcap = jobs->pidcap;
+    unsigned int h;
+    int i;
+
+    /* keep at most half the slots used (live or deleted) */
+    if (2 * (jobs->pidused + 1) > jobs->pidcap) {
+        while (4 * jobs->nprocs + 4 > jobs->pidcap)
+            jobs->pidcap *= 2;
+        if (!(jobs->bypid = calloc(jobs->pidcap, sizeof(struct pidslot_t))))
+            unix_error("calloc error");
+        jobs->pidused = 0;
+        jobs->nprocs = 0;
+        for (i = 0; i < oldcap; i++)
+            if (old[i].pid > 0)
+                pid_insert(jobs, old[i].pid, old[i].job);
+        free(old);
+    }
+
+    for (h = pidhash(pid, jobs->pidcap); jobs->bypid[h].pid > 0; h = (h + 1) & (jobs->pidcap - 1))
+        ;
+    if (jobs->bypid[h].pid == 0)
+        jobs->pidused++;
+    jobs->bypid[h].pid = pid;
+    jobs->bypid[h].job = job;
+    jobs->nprocs++;
+}
+
+/* pid_slot - Find the hash slot of pid, NULL if not there */
+static struct pidslot_t *pid_slot(struct jobs_t *jobs, pid_t pid)
+{
+    unsigned int h;
+
+    for (h = pidhash(pid, jobs->pidcap); jobs->bypid[h].pid != 0; h = (h + 1) & (jobs->pidcap - 1))
+        if (jobs->bypid[h].pid == pid)
+            return &jobs->bypid[h];
+    return NULL;
+}
+
+/* pid_remove - Forget pid (async-signal-safe) */
+static void pid_remove(struct jobs_t *jobs, pid_t pid)
+{
+    struct pidslot_t *slot;
+
+    if ((slot = pid_slot(jobs, pid))) {
+        slot->pid = -1; /* deleted: keeps probe chains intact */
+        slot->job = NULL;
+        jobs->nprocs--;
+    }
+}
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nstages = 0;
+    job->nalive = 0;
+    job->termsig = 0;
+    job->exitstatus = 0;
+    job->lastsig = 0;
+    job->outfd = -1;
+    job->timed = 0;
+    job->utime.tv_sec = job->utime.tv_usec = 0;
+    job->stime.tv_sec = job->stime.tv_usec = 0;
+    job->maxrss = 0;
+    job->cgfd = -1;
+    job->cgid = 0;
+    job->cmdline[0] = '\0';
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct jobs_t *jobs) {
+    jobs->jidcap = MAXJOBS;
+    jobs->pidcap = 4 * MAXJOBS;
+    if (!(jobs->byjid = calloc(jobs->jidcap, sizeof(struct job_t *))) ||
+        !(jobs->bypid = calloc(jobs->pidcap, sizeof(struct pidslot_t))))
+        unix_error("calloc error");
+    jobs->maxjid = 0;
+    jobs->pidused = 0;
+    jobs->nprocs = 0;
+    jobs->freelist = NULL;
+    jobs->fgjob = NULL;
+    jobs->fgpid = 0;
+    jobs->nrunning = 0;
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct jobs_t *jobs) 
+{
+    return jobs->maxjid;
+}
+
+/* setjobstate - Change the state of a job, keeping track of the FG job */
+void setjobstate(struct jobs_t *jobs, struct job_t *job, int state)
+{
+    jobs->nrunning += (state == FG || state == BG) - (job->state == FG || job->state == BG);
+    if (state == FG) {
+        jobs->fgjob = job;
+        jobs->fgpid = job->pid;
+    } else if (jobs->fgjob == job) {
+        jobs->fgjob = NULL;
+        jobs->fgpid = 0;
+    }
+    job->state = state;
+}
+
+/* addjob - Add a job to the job list */
+int addjob(struct jobs_t *jobs, pid_t pid, int state, char *cmdline) 
+{
+    struct job_t *job;
+    int jid;
+    
+    if (pid < 1)
+	return 0;
+
+    if ((job = jobs->freelist)) {
+	jobs->freelist = job->next;
+    } else if (!(job = malloc(sizeof(struct job_t)))) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+
+    jid = jobs->maxjid + 1;
+    if (jid >= jobs->jidcap) {
+	jobs->jidcap *= 2;
+	if (!(jobs->byjid = realloc(jobs->byjid, jobs->jidcap * sizeof(struct job_t *))))
+	    unix_error("realloc error");
+	memset(jobs->byjid + jid, 0, (jobs->jidcap - jid) * sizeof(struct job_t *));
+    }
+
+    clearjob(job);
+    job->pid = pid;
+    job->pids[0] = pid;
+    job->nstages = 1;
+    job->nalive = 1;
+    job->jid = jid;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    strcpy(job->cmdline, cmdline);
+    pid_insert(jobs, pid, job);
+    jobs->byjid[jid] = job;
+    jobs->maxjid = jid;
+    setjobstate(jobs, job, state);
+    if(verbose){
+	printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* addstage - Add another pipeline process to a job */
+void addstage(struct jobs_t *jobs, struct job_t *job, pid_t pid)
+{
+    if (job->nstages < MAXSTAGES) {
+        job->pids[job->nstages++] = pid;
+        job->nalive++;
+        pid_insert(jobs, pid, job);
+    }
+}
+
+/* 
+ * removestage - Mark a job's process reaped, return how many are left.
+ *    The leader's pid stays mapped until the job is deleted, so that
+ *    the job can still be named by its process group ID.
+ */
+int removestage(struct jobs_t *jobs, struct job_t *job, pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < job->nstages; i++) {
+	if (job->pids[i] == pid) {
+	    job->pids[i] = 0;
+	    job->nalive--;
+	    if (pid != job->pid)
+		pid_remove(jobs, pid);
+	    break;
+	}
+    }
+    return job->nalive;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct jobs_t *jobs, pid_t pid) 
+{
+    struct job_t *job;
+    int i;
+
+    if (!(job = getjobpid(jobs, pid)))
+	return 0;
+
+    for (i = 0; i < job->nstages; i++)
+	if (job->pids[i] && job->pids[i] != job->pid)
+	    pid_remove(jobs, job->pids[i]);
+    pid_remove(jobs, job->pid);
+
+    setjobstate(jobs, job, UNDEF);
+
+    jobs->byjid[job->jid] = NULL;
+    while (jobs->maxjid > 0 && !jobs->byjid[jobs->maxjid])
+	jobs->maxjid--;
+
+    clearjob(job);
+    job->next = jobs->freelist;
+    jobs->freelist = job;
+    return 1;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobs_t *jobs) {
+    return jobs->fgpid;
+}
+
+/* getjobpid  - Find a job (by PID of any of its processes) on the job list */
+struct job_t *getjobpid(struct jobs_t *jobs, pid_t pid) {
+    struct pidslot_t *slot;
+
+    if (pid < 1)
+	return NULL;
+    return (slot = pid_slot(jobs, pid)) ? slot->job : NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobs_t *jobs, int jid) 
+{
+    if (jid < 1 || jid > jobs->maxjid)
+	return NULL;
+    return jobs->byjid[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) 
+{
+    struct job_t *job = getjobpid(&jobs, pid);
+
+    return job ? job->jid : 0;
+}
+
+/*
+ * listjobs - Print the job list. The long format adds the resource usage
+ *    collected so far: time since start, and CPU time and max RSS of the
+ *    processes already reaped.
+ */
+void listjobs(struct jobs_t *jobs, int long_format) 
+{
+    int i;
+    struct job_t *job;
+    
+    for (i = 1; i <= jobs->maxjid; i++) {
+	if ((job = jobs->byjid[i]) != NULL) {
+	    printf("[%d] (%d) ", job->jid, job->pid);
+	    switch (job->state) {
+		case BG: 
+		    printf("Running ");
+		    break;
+		case FG: 
+		    printf("Foreground ");
+		    break;
+		case ST: 
+		    printf("Stopped ");
+		    break;
+	    default:
+		    printf("listjobs: Internal error: job[%d].state=%d ", 
+			   i, job->state);
+	    }
+	    printf("%s", job->cmdline);
+	    if (long_format) {
+		if (job->cgfd >= 0)
+		    cgroup_usage(job);
+		fflush(stdout);
+		print_usage("    ", job_real_ms(job), &job->utime, &job->stime, job->maxrss);
+	    }
+	}
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/*****************************************************
+ * Helper routines that manipulate the command hash table
+ *****************************************************/
+
+/* hash_str - djb2 string hash */
+static unsigned int hash_str(const char *str)
+{
+    unsigned int h = 5381;
+
+    while (*str)
+        h = h * 33 + (unsigned char)*str++;
+    return h % HASHSIZE;
+}
+
+/* hash_clear - Forget every hashed command */
+void hash_clear(void)
+{
+    int i;
+    struct cmdhash_t *entry, *next;
+
+    for (i = 0; i < HASHSIZE; i++) {
+        for (entry = cmdhash[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        cmdhash[i] = NULL;
+    }
+}
+
+/* hash_remove - Forget one hashed command, return 1 if it was hashed */
+int hash_remove(char *name)
+{
+    struct cmdhash_t **link, *entry;
+
+    for (link = &cmdhash[hash_str(name)]; (entry = *link); link = &entry->next) {
+        if (!strcmp(entry->name, name)) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* search_path - Find an executable regular file called name on PATH */
+static char *search_path(char *name, const char *pathvar)
+{
+    char candidate[MAXLINE];
+    struct stat st;
+    const char *dir = pathvar;
+    const char *end;
+    int dirlen;
+
+    while (dir) {
+        end = strchr(dir, ':');
+        dirlen = end ? end - dir : strlen(dir);
+
+        /* an empty PATH element means the current directory */
+        if (dirlen == 0) {
+            snprintf(candidate, MAXLINE, "%s", name);
+        } else {
+            snprintf(candidate, MAXLINE, "%.*s/%s", dirlen, dir, name);
+        }
+
+        if (!stat(candidate, &st) && S_ISREG(st.st_mode) && !access(candidate, X_OK)) {
+            return strdup(candidate);
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+/*
+ * find_cmd - Map a command name to the path to execute. Names containing
+ *    a slash are used as they are, others are looked up on PATH once and
+ *    remembered. The whole table is dropped when PATH changes.
+ */
+char *find_cmd(char *name)
+{
+    struct cmdhash_t *entry;
+    unsigned int h;
+    char *pathvar;
+    char *path;
+
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    if (!(pathvar = getenv("PATH"))) {
+        pathvar = "/bin:/usr/bin";
+    }
+    if (!hashed_path || strcmp(hashed_path, pathvar)) {
+        hash_clear();
+        free(hashed_path);
+        hashed_path = strdup(pathvar);
+    }
+
+    h = hash_str(name);
+    for (entry = cmdhash[h]; entry; entry = entry->next) {
+        if (!strcmp(entry->name, name)) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    if (!(path = search_path(name, pathvar))) {
+        return NULL;
+    }
+
+    entry = malloc(sizeof(struct cmdhash_t));
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = cmdhash[h];
+    cmdhash[h] = entry;
+    return path;
+}
+
+/*
+ * do_hash - Execute the builtin hash command: list the table, drop it
+ *    with -r, or look up and remember the given names
+ */
+void do_hash(char **argv)
+{
+    struct cmdhash_t *entry;
+    int i;
+
+    if (argv[1] && !strcmp(argv[1], "-r")) {
+        hash_clear();
+        return;
+    }
+
+    if (argv[1]) {
+        for (i = 1; argv[i]; i++) {
+            if (!find_cmd(argv[i])) {
+                printf("hash: %s: not found\n", argv[i]);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < HASHSIZE; i++) {
+        for (entry = cmdhash[i]; entry; entry = entry->next) {
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+}
+/***********************************
+ * end command hash helper routines
+ ***********************************/
+
+
+/*****************************************************
+ * Helper routines that manage the jobs' cgroups (-c)
+ *****************************************************/
+
+/*
+ * With -c DIR every job gets a cgroup v2 directory DIR/tsh<shell pid>.<n>,
+ * which its processes join between fork and exec, so they can't leave it
+ * by changing process group or daemonizing. The limits given with -C and
+ * -M are written to its cpu.max and memory.max, ctrl-c and the end of the
+ * job kill it all through cgroup.kill, and the job's usage is read from
+ * cpu.stat and memory.peak. The routines called from the SIGCHLD and
+ * SIGINT handlers stick to async-signal-safe calls.
+ */
+
+/* cgroup_write - Write value to the cgroup file dir/name, -1 on error */
+static int cgroup_write(int dir, char *name, char *value)
+{
+    int fd;
+    int rc;
+
+    if ((fd = openat(dir, name, O_WRONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    rc = (write(fd, value, strlen(value)) < 0) ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+/*
+ * cgroup_read - Read the number after key in the flat keyed cgroup file
+ *    dir/name, or the first number of the file if key is NULL. -1 if
+ *    there is no such file or key.
+ */
+static long long cgroup_read(int dir, char *name, char *key)
+{
+    char buf[1024];
+    char *p;
+    long long val;
+    int fd, n, keylen;
+
+    if ((fd = openat(dir, name, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    p = buf;
+    if (key) {
+        keylen = strlen(key);
+        while (strncmp(p, key, keylen) || p[keylen] != ' ') {
+            if (!(p = strchr(p, '\n')) || !*++p) {
+                return -1;
+            }
+        }
+        p += keylen + 1;
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return -1;              /* e.g. "max" */
+    }
+    for (val = 0; isdigit((unsigned char)*p); p++) {
+        val = val * 10 + (*p - '0');
+    }
+    return val;
+}
+
+/* cgroup_name - The name of job cgroup number id */
+static void cgroup_name(char *buf, int size, int id)
+{
+    snprintf(buf, size, "tsh%d.%d", (int)getpid(), id);
+}
+
+/*
+ * init_cgroups - Open the cgroup v2 directory the jobs' cgroups go in and
+ *    enable the controllers the limits need in it. The shell itself must
+ *    not be in there (cgroups with processes can't delegate controllers).
+ */
+void init_cgroups(char *path)
+{
+    if ((cgroup_root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        unix_error(path);
+    }
+    if (faccessat(cgroup_root, "cgroup.procs", W_OK, 0) < 0) {
+        unix_error("not a writable cgroup v2 directory");
+    }
+    if (cgroup_cpu && cgroup_write(cgroup_root, "cgroup.subtree_control", "+cpu") < 0) {
+        unix_error("can't enable the cpu controller");
+    }
+    if (cgroup_mem && cgroup_write(cgroup_root, "cgroup.subtree_control", "+memory") < 0) {
+        unix_error("can't enable the memory controller");
+    }
+    atexit(cgroup_sweep);
+}
+
+/*
+ * cgroup_create - Make the cgroup of a new job, with the -C/-M limits.
+ *    Return its directory and set *id, or return -1 after reporting why
+ *    it can't be made.
+ */
+int cgroup_create(int *id)
+{
+    char name[64];
+    int dir;
+
+    cgroup_sweep();             /* the cgroups that were still busy */
+    *id = ++cgroup_seq;
+    cgroup_name(name, sizeof(name), *id);
+    if (mkdirat(cgroup_root, name, 0755) < 0) {
+        printf("cgroup %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if ((dir = openat(cgroup_root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        unix_error("cgroup open error");
+    }
+    if ((cgroup_cpu && cgroup_write(dir, "cpu.max", cgroup_cpu) < 0) ||
+        (cgroup_mem && cgroup_write(dir, "memory.max", cgroup_mem) < 0)) {
+        printf("cgroup %s: can't set limits: %s\n", name, strerror(errno));
+        close(dir);
+        cgroup_remove(*id);
+        return -1;
+    }
+    return dir;
+}
+
+/*
+ * cgroup_remove - Remove job cgroup number id. Fails while the processes
+ *    that were just killed are still on their way out, cgroup_sweep
+ *    retries later.
+ */
+void cgroup_remove(int id)
+{
+    char name[64];
+
+    cgroup_name(name, sizeof(name), id);
+    unlinkat(cgroup_root, name, AT_REMOVEDIR);
+}
+
+/* cgroup_sweep - Remove the finished jobs' cgroups that were still busy */
+void cgroup_sweep(void)
+{
+    char prefix[32];
+    struct dirent *de;
+    DIR *dir;
+    int fd;
+
+    if ((fd = openat(cgroup_root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return;
+    }
+    if (!(dir = fdopendir(fd))) {
+        close(fd);
+        return;
+    }
+    snprintf(prefix, sizeof(prefix), "tsh%d.", (int)getpid());
+    while ((de = readdir(dir))) {
+        if (!strncmp(de->d_name, prefix, strlen(prefix))) {
+            unlinkat(cgroup_root, de->d_name, AT_REMOVEDIR); /* EBUSY if a job's */
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * cgroup_kill - SIGKILL every process in the job's cgroup, falling back to
+ *    SIGINT to its process group on kernels without cgroup.kill
+ */
+void cgroup_kill(struct job_t *job)
+{
+    if (cgroup_write(job->cgfd, "cgroup.kill", "1") < 0 && job->nalive > 0) {
+        kill(-job->pid, SIGINT);
+    }
+}
+
+/*
+ * cgroup_usage - Take the job's usage from its cgroup, so it covers every
+ *    process that ran in it. maxrss becomes memory.peak, which includes
+ *    the page cache the job caused.
+ */
+void cgroup_usage(struct job_t *job)
+{
+    long long usec;
+
+    if ((usec = cgroup_read(job->cgfd, "cpu.stat", "user_usec")) >= 0) {
+        job->utime.tv_sec = usec / 1000000;
+        job->utime.tv_usec = usec % 1000000;
+    }
+    if ((usec = cgroup_read(job->cgfd, "cpu.stat", "system_usec")) >= 0) {
+        job->stime.tv_sec = usec / 1000000;
+        job->stime.tv_usec = usec % 1000000;
+    }
+    if ((usec = cgroup_read(job->cgfd, "memory.peak", NULL)) >= 0) {
+        job->maxrss = usec / 1024;
+    }
+}
+/**************************************
+ * end cgroup helper routines
+ **************************************/
+
+
+/*****************************************************
+ * Helper routines for the command result cache ("cached")
+ *****************************************************/
+
+/*
+ * "cached cmd ..." looks the job up in an on-disk cache, $TSH_CACHE_DIR or
+ * ~/.cache/tsh, keyed by a digest of everything the output of a
+ * deterministic job depends on: the argv of every stage, the programs
+ * run (path, size and mtime), the contents of the < files and of the
+ * arguments naming regular files, the working directory, and the
+ * environment variables listed in $TSH_CACHE_ENV (default PATH). On a hit
+ * the stored stdout is written where the job's stdout goes and its exit
+ * status becomes $?, without running anything. On a miss the job runs
+ * with its stdout going to a temporary file, which becomes the entry if
+ * the job exits (rather than being killed) and is then replayed, so the
+ * output only shows up when the job is done. stderr isn't cached.
+ *
+ * An entry is the output followed by a CACHE_TRAILER-byte trailer with
+ * the exit status, and is renamed into place whole.
+ */
+#define CACHE_TRAILER 16
+
+struct digest_t {           /* A 128-bit digest, as two 64-bit lanes */
+    unsigned long long a;   /* FNV-1a */
+    unsigned long long b;   /* multiply-xorshift */
+};
+
+/* digest_add - Feed n bytes to the digest */
+static void digest_add(struct digest_t *d, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+
+    while (n--) {
+        d->a = (d->a ^ *p) * 0x100000001b3ULL;
+        d->b = (d->b + *p + 1) * 0x9e3779b97f4a7c15ULL;
+        d->b ^= d->b >> 29;
+        p++;
+    }
+}
+
+/* digest_str - Feed a string and its NUL to the digest */
+static void digest_str(struct digest_t *d, const char *str)
+{
+    digest_add(d, str, strlen(str) + 1);
+}
+
+/* digest_file - Feed the contents of a file to the digest, -1 on error */
+static int digest_file(struct digest_t *d, const char *path)
+{
+    char buf[65536];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        digest_add(d, buf, n);
+    }
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+/*
+ * cache_key - Digest the things the output of pipeline pl depends on. -1
+ *    if something can't be read, the job then runs uncached and reports
+ *    the problem itself.
+ */
+static int cache_key(struct pipeline_t *pl, struct digest_t *d)
+{
+    struct cmd_t *cmd;
+    struct stat st;
+    char cwd[MAXLINE];
+    char *names, *name, *value;
+    char **arg;
+    char *path;
+
+    d->a = 0xcbf29ce484222325ULL;
+    d->b = 0x84222325cbf29ce4ULL;
+
+    for (cmd = pl->cmds; cmd < pl->cmds + pl->ncmds; cmd++) {
+        if (!(path = find_cmd(cmd->argv[0])) || stat(path, &st) < 0) {
+            return -1;
+        }
+        digest_str(d, path);
+        digest_add(d, &st.st_size, sizeof(st.st_size));
+        digest_add(d, &st.st_mtim, sizeof(st.st_mtim));
+
+        for (arg = cmd->argv; *arg; arg++) {
+            digest_str(d, *arg);
+            if (arg != cmd->argv && stat(*arg, &st) == 0 && S_ISREG(st.st_mode) && digest_file(d, *arg) < 0) {
+                return -1;
+            }
+        }
+        if (cmd->infile) {
+            digest_str(d, "<");
+            digest_str(d, cmd->infile);
+            if (digest_file(d, cmd->infile) < 0) {
+                return -1;
+            }
+        }
+        digest_str(d, "|");
+    }
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return -1;
+    }
+    digest_str(d, cwd);
+
+    if (!(names = strdup(getenv("TSH_CACHE_ENV") ? getenv("TSH_CACHE_ENV") : "PATH"))) {
+        unix_error("strdup error");
+    }
+    for (name = strtok(names, ":"); name; name = strtok(NULL, ":")) {
+        value = getenv(name);
+        digest_str(d, name);
+        digest_str(d, value ? value : "");
+    }
+    free(names);
+    return 0;
+}
+
+/* cache_dir - Find (and make) the cache directory, -1 if there is none */
+static int cache_dir(char *buf, int size)
+{
+    char *dir, *home;
+
+    if ((dir = getenv("TSH_CACHE_DIR"))) {
+        snprintf(buf, size, "%s", dir);
+    } else if ((home = getenv("HOME"))) {
+        snprintf(buf, size, "%s/.cache", home);
+        mkdir(buf, 0755);
+        snprintf(buf, size, "%s/.cache/tsh", home);
+    } else {
+        return -1;
+    }
+    if (mkdir(buf, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * cache_replay - Copy the first len bytes of fd where the job's stdout
+ *    goes. Return -1 after reporting a failed open.
+ */
+static int cache_replay(struct cache_t *cache, int fd, off_t len)
+{
+    char buf[65536];
+    ssize_t n;
+    int out = STDOUT_FILENO;
+
+    fflush(stdout);
+    if (cache->outfile) {
+        out = open(cache->outfile, O_WRONLY | O_CREAT | O_CLOEXEC | (cache->append ? O_APPEND : O_TRUNC), 0666);
+        if (out < 0) {
+            printf("%s: %s\n", cache->outfile, strerror(errno));
+            return -1;
+        }
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    while (len > 0 && (n = read(fd, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf))) > 0) {
+        wrap_write(out, buf, n);
+        len -= n;
+    }
+
+    if (out != STDOUT_FILENO) {
+        close(out);
+    }
+    return 0;
+}
+
+/*
+ * cache_lookup - Look the pipeline up in the cache. On a hit replay it,
+ *    set last_status and return 1. On a miss return 0 with the last
+ *    stage's stdout sent to cache->tmp, to be stored by cache_store once
+ *    the job is done; cache->tmp is "" if the job can't be cached.
+ */
+int cache_lookup(struct pipeline_t *pl, struct cache_t *cache)
+{
+    struct cmd_t *last = &pl->cmds[pl->ncmds - 1];
+    struct digest_t d;
+    char dir[MAXLINE - 64];   /* room for the entry name */
+    char trailer[CACHE_TRAILER + 1];
+    struct stat st;
+    int fd;
+
+    cache->tmp[0] = '\0';
+    cache->outfile = last->outfile;
+    cache->append = last->append;
+    if (cache_key(pl, &d) < 0 || cache_dir(dir, sizeof(dir)) < 0) {
+        return 0;
+    }
+    snprintf(cache->entry, MAXLINE, "%s/%016llx%016llx", dir, d.a, d.b);
+
+    if ((fd = open(cache->entry, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size >= CACHE_TRAILER &&
+            pread(fd, trailer, CACHE_TRAILER, st.st_size - CACHE_TRAILER) == CACHE_TRAILER &&
+            !strncmp(trailer, "tshc", 4)) {
+            trailer[CACHE_TRAILER] = '\0';
+            cache_replay(cache, fd, st.st_size - CACHE_TRAILER);
+            last_status = atoi(trailer + 4);
+            close(fd);
+            return 1;
+        }
+        close(fd);            /* not an entry: overwrite it */
+    }
+
+    snprintf(cache->tmp, MAXLINE, "%s/tmp.XXXXXX", dir);
+    if ((fd = mkstemp(cache->tmp)) < 0) {
+        cache->tmp[0] = '\0';
+        return 0;
+    }
+    close(fd);
+    last->outfile = cache->tmp;
+    last->append = 0;
+    return 0;
+}
+
+/*
+ * cache_store - Once a job set up by cache_lookup is done, make its output
+ *    the cache entry if it exited, and show the output
+ */
+void cache_store(struct cache_t *cache, pid_t pgid)
+{
+    char trailer[CACHE_TRAILER + 1];
+    sigset_t prev_mask;
+    struct stat st;
+    int stopped;
+    int fd;
+
+    block_sigchld(&prev_mask);
+    stopped = (getjobpid(&jobs, pgid) != NULL);
+    unblock_sigchld(&prev_mask);
+    if (stopped) {
+        printf("cached: the output of the stopped job goes to %s\n", cache->tmp);
+        return;
+    }
+
+    if ((fd = open(cache->tmp, O_RDWR | O_APPEND | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        /* not worth ending the shell for: just don't cache it */
+        printf("cached: %s: %s\n", cache->tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(cache->tmp);
+        return;
+    }
+    cache_replay(cache, fd, st.st_size);
+    if (!last_killed) {       /* exited, even with a status >= 128 */
+        snprintf(trailer, sizeof(trailer), "tshc%11d\n", (int)last_status);
+        if (write(fd, trailer, CACHE_TRAILER) != CACHE_TRAILER || rename(cache->tmp, cache->entry) < 0) {
+            unlink(cache->tmp);
+        }
+    } else {
+        unlink(cache->tmp);
+    }
+    close(fd);
 }
+/*****************************************************
+ * end command result cache helper routines
+ *****************************************************/
+
+
+/*****************************************************
+ * Helper routines for the startup profiler (-P)
+ *****************************************************/
+
+/*
+ * With -P the startup of every FG job is timed from just before its first
+ * stage is started, to:
+ *   - fork or posix_spawn having returned for every stage,
+ *   - every stage having exec'd: all stages inherit the write end of a
+ *     close-on-exec pipe, which hits EOF once the last one is closed,
+ *   - the first byte of output: the last stage's stdout is a pipe the
+ *     shell copies to its own stdout,
+ *   - the last stage having exited: its pidfd becomes readable,
+ *   - the shell having reaped the job.
+ * While the job runs SIGCHLD stays blocked and is read from a signalfd
+ * that is polled along with those descriptors, so no milestone is seen
+ * late because a signal handler got in first. The percentiles over all
+ * profiled jobs are printed when the shell exits. BG jobs are not
+ * profiled.
+ */
 
-/*********************
- * End signal handlers
- *********************/
+/* us_since - Microseconds elapsed since start */
+static long us_since(struct timespec *start)
+{
+    struct timespec now;
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/*
+ * init_profile - Set up -P: the SIGCHLD signalfd profile_wait polls (the
+ *     one of -e if there is one), and the report at exit
+ */
+void init_profile(void)
+{
+    sigset_t mask;
+
+    if (event_mode) {
+        prof_sigfd = sigchld_fd;
+    } else {
+        wrap_sigemptyset(&mask);
+        wrap_sigaddset(&mask, SIGCHLD);
+        if ((prof_sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+            unix_error("signalfd error");
+        }
+    }
+    atexit(profile_report);
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+/* profile_setup - Make the pipes of a FG job about to be started */
+void profile_setup(struct profile_t *prof)
+{
+    int exec_pipe[2], out_pipe[2];
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+    if (pipe2(exec_pipe, O_CLOEXEC) < 0 || pipe2(out_pipe, O_CLOEXEC) < 0) {
+        unix_error("Pipe error");
+    }
+    prof->exec_fd = exec_pipe[0];
+    prof->exec_w = exec_pipe[1];
+    prof->out_fd = out_pipe[0];
+    prof->out_w = out_pipe[1];
+    /* only the shell's end: once the job is gone, what is left is read
+       without waiting for writers the job may have left behind */
+    fcntl(prof->out_fd, F_SETFL, O_NONBLOCK);
+    for (i = 0; i < NMILESTONES; i++) {
+        prof->us[i] = -1;
+    }
+    prof->npidfds = 0;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
+/*
+ * profile_started - Called by start_job once every stage has been started:
+ *     drop the write ends, so that only the stages hold them, and open a
+ *     pidfd per stage. SIGCHLD is blocked, so none of them has been reaped.
+ */
+void profile_started(struct profile_t *prof, pid_t *pids, int npids)
+{
+    int i, fd;
+
+    prof->us[0] = us_since(&prof->start);
+    close(prof->exec_w);
+    close(prof->out_w);
+    prof->exec_w = prof->out_w = -1;
+    for (i = 0; i < npids; i++) {
+        if ((fd = syscall(SYS_pidfd_open, pids[i], 0)) >= 0) {
+            prof->pidfds[prof->npidfds++] = fd;
+        }
+    }
+}
+
+/* fd_ready - Is fd readable right now? */
+static int fd_ready(int fd)
 {
-    int i, max=0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    return poll(&pfd, 1, 0) > 0;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* copy_output - Copy what a profiled job wrote to stdout; 0 at EOF */
+static int copy_output(struct profile_t *prof)
 {
-    int i;
-    
-    if (pid < 1)
-	return 0;
+    char buf[8192];
+    ssize_t n;
+
+    while ((n = read(prof->out_fd, buf, sizeof(buf))) > 0) {
+        if (prof->us[2] < 0) {
+            prof->us[2] = us_since(&prof->start);
+        }
+        if (wrap_write(STDOUT_FILENO, buf, n) < 0) {
+            break;
+        }
+    }
+    return n != 0;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+/*
+ * relay_output - Give the output pipe of a profiled job that stopped a
+ *     reader of its own: a child outside any job that copies it to stdout
+ *     until the job closes it, so that once resumed the job doesn't write
+ *     into a pipe nobody reads. reap_children ignores the child's exit.
+ */
+static void relay_output(int fd)
+{
+    char buf[8192];
+    ssize_t n;
+
+    if (wrap_fork() == 0) {
+        Signal(SIGINT, SIG_IGN);  /* meant for the jobs, not for us */
+        Signal(SIGTSTP, SIG_IGN);
+        Signal(SIGQUIT, SIG_IGN);
+        fcntl(fd, F_SETFL, 0);
+        while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0 && write(STDOUT_FILENO, buf, n) < 0) {
+                break;
             }
-            return 1;
-	}
+        }
+        _exit(0);
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/*
+ * profile_wait - waitfg for a profiled job: wait until it is reaped or
+ *     stopped, recording the milestones and copying its output meanwhile.
+ *     The output of a job that stopped goes through relay_output from then on.
+ */
+void profile_wait(struct profile_t *prof, pid_t pgid)
 {
-    int i;
+    sigset_t prev_mask;
+    struct pollfd pfds[MAXSTAGES + 4];
+    struct signalfd_siginfo info[16];
+    struct job_t *job;
+    int i, nfds, stopped = 0;
+
+    block_sigchld(&prev_mask);
+
+    while (fgpid(&jobs) == pgid) {
+        nfds = 0;
+        pfds[nfds++] = (struct pollfd){ .fd = prof_sigfd, .events = POLLIN };
+        pfds[nfds++] = (struct pollfd){ .fd = prof->exec_fd, .events = POLLIN };
+        pfds[nfds++] = (struct pollfd){ .fd = prof->out_fd, .events = POLLIN };
+        pfds[nfds++] = (struct pollfd){ .fd = tag_output ? out_epfd : -1, .events = POLLIN };
+        for (i = 0; i < prof->npidfds; i++) {
+            pfds[nfds++] = (struct pollfd){ .fd = prof->pidfds[i], .events = POLLIN };
+        }
 
-    if (pid < 1)
-	return 0;
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("poll error");
+        }
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
+        if (pfds[1].revents) {   /* EOF: the last stage exec'd or died */
+            prof->us[1] = us_since(&prof->start);
+            close(prof->exec_fd);
+            prof->exec_fd = -1;
+        }
+        if (pfds[2].revents && !copy_output(prof)) {
+            close(prof->out_fd);
+            prof->out_fd = -1;
+        }
+        for (i = 0; i < prof->npidfds; i++) {
+            if (pfds[4 + i].revents && prof->pidfds[i] >= 0) {
+                prof->us[3] = us_since(&prof->start);
+                close(prof->pidfds[i]);
+                prof->pidfds[i] = -1;
+            }
+        }
+        if (pfds[3].revents) {
+            drain_streams(0, NULL);
+        }
+        if (pfds[0].revents) {
+            while (read(prof_sigfd, info, sizeof(info)) > 0)
+                ;
+            reap_children();
+        }
+    }
+
+    if ((job = getjobpid(&jobs, pgid)) && job->state == ST) {
+        stopped = 1;
+    } else {
+        /* the wakeup that reaped the job may have come before its last
+           exec or exit was seen */
+        if (prof->exec_fd >= 0 && fd_ready(prof->exec_fd)) {
+            prof->us[1] = us_since(&prof->start);
+        }
+        for (i = 0; i < prof->npidfds; i++) {
+            if (prof->pidfds[i] >= 0 && fd_ready(prof->pidfds[i])) {
+                prof->us[3] = us_since(&prof->start);
+            }
+        }
+        prof->us[4] = us_since(&prof->start);
+    }
+
+    /* the job is gone, and with it its output: whatever is left in the
+       pipe is all there will be from it. A stopped one may write more */
+    if (prof->out_fd >= 0) {
+        if (stopped) {
+            relay_output(prof->out_fd);
+        } else {
+            copy_output(prof);
+        }
+        close(prof->out_fd);
+    }
+    if (prof->exec_fd >= 0) {
+        close(prof->exec_fd);
+    }
+    for (i = 0; i < prof->npidfds; i++) {
+        if (prof->pidfds[i] >= 0) {
+            close(prof->pidfds[i]);
+        }
+    }
+    unblock_sigchld(&prev_mask);
+
+    if (stopped) {
+        return;               /* not a complete timeline */
+    }
+    if (prof_nsamples == prof_cap) {
+        prof_cap = prof_cap ? 2 * prof_cap : 64;
+        for (i = 0; i < NMILESTONES; i++) {
+            if (!(prof_samples[i] = realloc(prof_samples[i], prof_cap * sizeof(long)))) {
+                unix_error("realloc error");
+            }
+        }
+    }
+    for (i = 0; i < NMILESTONES; i++) {
+        prof_samples[i][prof_nsamples] = prof->us[i];
+    }
+    prof_nsamples++;
+
+    if (verbose) {
+        printf("profile:");
+        for (i = 0; i < NMILESTONES; i++) {
+            printf(" %ld", prof->us[i]);
+        }
+        printf(" us\n");
+    }
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * profile_report - Print the percentiles of the time to each milestone
+ *     over all profiled jobs (at exit). A job that never wrote anything
+ *     doesn't count for the first output.
+ */
+void profile_report(void)
+{
+    long *v;
+    int i, j, n;
+
+    if (!prof_nsamples) {
+        return;
+    }
+    printf("startup profile of %d jobs, ms after the start:\n", prof_nsamples);
+    printf("%-20s %7s %9s %9s %9s %9s\n", "", "jobs", "p50", "p90", "p99", "max");
+    for (i = 0; i < NMILESTONES; i++) {
+        v = prof_samples[i];
+        for (j = n = 0; j < prof_nsamples; j++) {
+            if (v[j] >= 0) {
+                v[n++] = v[j];
+            }
+        }
+        if (!n) {
+            printf("%-20s %7d\n", milestones[i], 0);
+            continue;
+        }
+        qsort(v, n, sizeof(long), cmp_long);
+        printf("%-20s %7d %9.3f %9.3f %9.3f %9.3f\n", milestones[i], n,
+               v[(n - 1) * 50 / 100] / 1000.0, v[(n - 1) * 90 / 100] / 1000.0,
+               v[(n - 1) * 99 / 100] / 1000.0, v[n - 1] / 1000.0);
     }
+    fflush(stdout);
+}
+
+/*****************************************************
+ * end startup profiler helper routines
+ *****************************************************/
+
+
+/*****************************************************
+ * Builtin commands
+ *****************************************************/
+
+/*
+ * The job control builtins and the common utilities scripts are full of
+ * run in the shell, found through a hash table, instead of paying for a
+ * fork and exec each. Each takes its argv and returns its exit status.
+ * They only run in the shell on their own; a builtin name in a pipeline
+ * runs the program of that name. An absolute path always runs the program.
+ */
+
+static int bi_quit(char **argv)
+{
+    exit(0);
+}
+
+/* bi_exit - Like quit, but with status argv[1] or else the last one */
+static int bi_exit(char **argv)
+{
+    exit(argv[1] ? atoi(argv[1]) : last_status);
+}
+
+static int bi_jobs(char **argv)
+{
+    listjobs(&jobs, argv[1] && !strcmp(argv[1], "-l"));
     return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+static int bi_bgfg(char **argv)
+{
+    last_status = 0;
+    do_bgfg(argv);
+    return strcmp(argv[0], "fg") ? 0 : last_status; /* fg: what the job left */
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
+static int bi_hash(char **argv)
+{
+    do_hash(argv);
     return 0;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+static int bi_wait(char **argv)
+{
+    do_wait();
+    return 0;
+}
 
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+static int bi_true(char **argv)
+{
+    return 0;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+static int bi_false(char **argv)
 {
-    int i;
+    return 1;
+}
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+/* bi_echo - echo [-n] [arg ...], no escapes (like bash without -e) */
+static int bi_echo(char **argv)
+{
+    int newline = 1;
+    char **arg = argv + 1;
+
+    if (*arg && !strcmp(*arg, "-n")) {
+        newline = 0;
+        arg++;
+    }
+    for (; *arg; arg++) {
+        fputs(*arg, stdout);
+        if (arg[1]) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) 
+/* printf_escape - Print the character escape \c stands for */
+static void printf_escape(char c)
 {
-    int i;
+    switch (c) {
+    case 'n': putchar('\n'); break;
+    case 't': putchar('\t'); break;
+    case 'r': putchar('\r'); break;
+    case 'a': putchar('\a'); break;
+    case '\\': putchar('\\'); break;
+    default: putchar('\\'); putchar(c); break;
+    }
+}
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+/*
+ * bi_printf - printf format [arg ...]. Knows the escapes above and the
+ *    %s %c %d %i %u %o %x %X %% conversions with flags, width and
+ *    precision; the format is reused while arguments are left.
+ */
+static int bi_printf(char **argv)
+{
+    char spec[32];
+    char one[2] = "";
+    char *fmt, *p;
+    char **arg;
+    int n, used;
+
+    if (!(fmt = argv[1])) {
+        printf("printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    arg = argv + 2;
+    do {
+        used = 0;
+        for (p = fmt; *p; p++) {
+            if (*p == '\\' && p[1]) {
+                printf_escape(*++p);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            /* copy flags, width and precision, add ll for the integers */
+            spec[0] = '%';
+            for (n = 1, p++; *p && strchr("-+ #0123456789.", *p) && n < 24; p++) {
+                spec[n++] = *p;
+            }
+            if (*p && strchr("diuoxX", *p)) {
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+            }
+            spec[n++] = *p;
+            spec[n] = '\0';
+
+            switch (*p) {
+            case 's':
+                printf(spec, *arg ? *arg : "");
+                break;
+            case 'c':
+                one[0] = *arg ? **arg : '\0';
+                spec[n - 1] = 's';
+                printf(spec, one);
+                break;
+            case 'd': case 'i':
+                printf(spec, *arg ? strtoll(*arg, NULL, 0) : 0LL);
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                printf(spec, *arg ? strtoull(*arg, NULL, 0) : 0ULL);
+                break;
+            default:
+                printf("printf: %s: invalid conversion\n", spec);
+                return 1;
+            }
+            if (*arg) {
+                arg++;
+                used = 1;
+            }
         }
+    } while (*arg && used);
     return 0;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+/* test_unary - Evaluate test's unary operator op on arg, -1 if unknown */
+static int test_unary(char *op, char *arg)
 {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG: 
-		    printf("Running ");
-		    break;
-		case FG: 
-		    printf("Foreground ");
-		    break;
-		case ST: 
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
-			   i, jobs[i].state);
-	    }
-	    printf("%s", jobs[i].cmdline);
-	}
+    struct stat st;
+
+    if (!strcmp(op, "-n")) return *arg != '\0';
+    if (!strcmp(op, "-z")) return *arg == '\0';
+    if (!strcmp(op, "-r")) return access(arg, R_OK) == 0;
+    if (!strcmp(op, "-w")) return access(arg, W_OK) == 0;
+    if (!strcmp(op, "-x")) return access(arg, X_OK) == 0;
+    if (strlen(op) != 2 || op[0] != '-' || !strchr("edfsLh", op[1])) {
+        return -1;
+    }
+    if ((op[1] == 'L' || op[1] == 'h') ? lstat(arg, &st) < 0 : stat(arg, &st) < 0) {
+        return 0;
+    }
+    switch (op[1]) {
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'L': case 'h': return S_ISLNK(st.st_mode);
+    default:  return 1;
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
+
+/* test_binary - Evaluate test's binary operator op, -1 if unknown */
+static int test_binary(char *a, char *op, char *b)
+{
+    long long x, y;
+
+    if (!strcmp(op, "=") || !strcmp(op, "==")) return strcmp(a, b) == 0;
+    if (!strcmp(op, "!=")) return strcmp(a, b) != 0;
+
+    x = strtoll(a, NULL, 10);
+    y = strtoll(b, NULL, 10);
+    if (!strcmp(op, "-eq")) return x == y;
+    if (!strcmp(op, "-ne")) return x != y;
+    if (!strcmp(op, "-lt")) return x < y;
+    if (!strcmp(op, "-le")) return x <= y;
+    if (!strcmp(op, "-gt")) return x > y;
+    if (!strcmp(op, "-ge")) return x >= y;
+    return -1;
+}
+
+/* test_eval - Evaluate the argc test arguments (POSIX rules, up to 4) */
+static int test_eval(int argc, char **argv)
+{
+    int r;
+
+    switch (argc) {
+    case 0:
+        return 0;
+    case 1:
+        return *argv[0] != '\0';
+    case 2:
+        if (!strcmp(argv[0], "!")) {
+            return !test_eval(1, argv + 1);
+        }
+        return test_unary(argv[0], argv[1]);
+    case 3:
+        if ((r = test_binary(argv[0], argv[1], argv[2])) >= 0) {
+            return r;
+        }
+        if (!strcmp(argv[0], "!") && (r = test_eval(2, argv + 1)) >= 0) {
+            return !r;
+        }
+        return -1;
+    case 4:
+        if (!strcmp(argv[0], "!") && (r = test_eval(3, argv + 1)) >= 0) {
+            return !r;
+        }
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+/* bi_test - test expr and [ expr ]: 0 if true, 1 if false, 2 on error */
+static int bi_test(char **argv)
+{
+    int argc;
+    int r;
+
+    for (argc = 0; argv[argc + 1]; argc++)
+        ;
+    if (!strcmp(argv[0], "[")) {
+        if (argc == 0 || strcmp(argv[argc], "]")) {
+            printf("[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    if ((r = test_eval(argc, argv + 1)) < 0) {
+        printf("%s: syntax error\n", argv[0]);
+        return 2;
+    }
+    return !r;
+}
+
+/* bi_cd - cd [dir | -], keeping PWD and OLDPWD up to date */
+static int bi_cd(char **argv)
+{
+    char *dir = argv[1];
+    char cwd[4096];
+
+    if (!dir && !(dir = getenv("HOME"))) {
+        printf("cd: HOME not set\n");
+        return 1;
+    }
+    if (!strcmp(dir, "-") && !(dir = getenv("OLDPWD"))) {
+        printf("cd: OLDPWD not set\n");
+        return 1;
+    }
+    if (chdir(dir) < 0) {
+        printf("cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (getenv("PWD")) {
+        setenv("OLDPWD", getenv("PWD"), 1);
+    }
+    if (getcwd(cwd, sizeof(cwd))) {
+        setenv("PWD", cwd, 1);
+    }
+    if (argv[1] && !strcmp(argv[1], "-")) {
+        printf("%s\n", cwd);
+    }
+    return 0;
+}
+
+static int bi_pwd(char **argv)
+{
+    char cwd[4096];
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        printf("pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+/* bi_export - export NAME=VALUE ...: put variables in the environment */
+static int bi_export(char **argv)
+{
+    char **arg;
+    char *eq;
+    int status = 0;
+
+    for (arg = argv + 1; *arg; arg++) {
+        if ((eq = strchr(*arg, '=')) && eq != *arg) {
+            *eq = '\0';
+            if (setenv(*arg, eq + 1, 1) < 0) {
+                printf("export: %s: %s\n", *arg, strerror(errno));
+                status = 1;
+            }
+            *eq = '=';
+        } else if (!eq && getenv(*arg) == NULL) {
+            setenv(*arg, "", 0);
+        }
+    }
+    return status;
+}
+
+static struct builtin_t builtin_list[] = {
+    { "quit", bi_quit },
+    { "exit", bi_exit },
+    { "jobs", bi_jobs },
+    { "bg", bi_bgfg },
+    { "fg", bi_bgfg },
+    { "hash", bi_hash },
+    { "wait", bi_wait },
+    { "true", bi_true },
+    { ":", bi_true },
+    { "false", bi_false },
+    { "echo", bi_echo },
+    { "printf", bi_printf },
+    { "test", bi_test },
+    { "[", bi_test },
+    { "cd", bi_cd },
+    { "pwd", bi_pwd },
+    { "export", bi_export },
+    { NULL, NULL }
+};
+
+/* init_builtins - Hash the builtin commands by name */
+void init_builtins(void)
+{
+    struct builtin_t *builtin;
+    unsigned int h;
+
+    for (builtin = builtin_list; builtin->name; builtin++) {
+        h = hash_str(builtin->name) % BUILTINHASH;
+        builtin->next = builtins[h];
+        builtins[h] = builtin;
+    }
+}
+
+/* find_builtin - The builtin command called name, or NULL */
+struct builtin_t *find_builtin(char *name)
+{
+    struct builtin_t *builtin;
+
+    for (builtin = builtins[hash_str(name) % BUILTINHASH]; builtin; builtin = builtin->next) {
+        if (!strcmp(builtin->name, name)) {
+            return builtin;
+        }
+    }
+    return NULL;
+}
+/*****************************************************
+ * end builtin commands
+ *****************************************************/
 
 
 /***********************
@@ -659,10 +3687,23 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpfeaoP] [-j N] [-c DIR [-C PCT] [-M SIZE]]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -f   launch jobs with fork+execve instead of posix_spawn\n");
+    printf("   -e   reap children from a signalfd event loop, not a handler\n");
+    printf("   -a   report time and max RSS of every job when it completes\n");
+    printf("   -o   print BG jobs' output line by line tagged with the job ID,\n");
+    printf("        and report their completion at the next prompt\n");
+    printf("   -P   time the startup of FG jobs (spawn, exec, first output,\n");
+    printf("        exit, reap) and print percentiles when the shell exits\n");
+    printf("   -j N run the commands read from stdin N at a time, printing the\n");
+    printf("        output of each as it completes; 'wait' lines are barriers\n");
+    printf("   -c DIR run each job in a cgroup of its own under the cgroup v2\n");
+    printf("        directory DIR; ctrl-c and the end of the job kill all of it\n");
+    printf("   -C PCT limit each job to PCT percent of a CPU (with -c)\n");
+    printf("   -M SIZE limit each job's memory to SIZE bytes, K/M/G allowed (with -c)\n");
     exit(1);
 }
 
@@ -753,6 +3794,19 @@ pid_t wrap_waitpid(pid_t pid, int *iptr, int options)
     return(retpid);
 }
 
+pid_t wrap_wait4(pid_t pid, int *iptr, int options, struct rusage *ru) 
+{
+    pid_t retpid;
+
+    if ((retpid  = wait4(pid, iptr, options, ru)) < 0) {
+        if (errno != ECHILD) {
+	        unix_error("Wait4 error");
+        }
+    }
+
+    return(retpid);
+}
+
 /* $begin kill */
 void wrap_kill(pid_t pid, int signum) 
 {